@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
@@ -7,7 +8,9 @@
 
 #define DATA_TIMER 1500 // Data帧超时
 #define ACK_TIMER 280   // Ack帧超时
+#ifndef MAX_SEQ // 可在编译时用 -DMAX_SEQ=<n> 改变窗口, 配合 --bond 测量窗口随带宽的伸缩 (n < 256)
 #define MAX_SEQ 31
+#endif
 #define NR_BUFS ((MAX_SEQ + 1) / 2) // 窗口大小 (必须是偶数)
 #define MAX_WINDOW_SIZE NR_BUFS
 
@@ -38,240 +41,287 @@ static bool between(seq_nr a, seq_nr b, seq_nr c) // 判断序号是否在窗口
     return ((a <= b && b < c) || (c < a && a <= b) || (b < c && c < a));
 }
 
-// --- 全局变量 ---
-static seq_nr next_frame_to_send = 0; // 发送方下一个要发送的帧序号
-static seq_nr ack_expected = 0;       // 发送方下一个要确认的帧序号
-static seq_nr frame_expected = 0;     // 接收方下一个要接收的帧序号
-static seq_nr too_far;                // 接收方下一个要接收的帧序号 (窗口上界)
-
-static unsigned char out_buf[NR_BUFS][PKT_LEN]; // 发送方缓冲区
-static unsigned char in_buf[NR_BUFS][PKT_LEN];  // 接收方缓冲区
-static bool arrived[NR_BUFS];                   // 接收方缓冲区位图 (标记哪些槽已填充)
-
-static int nbuffered = 0;  // 发送方缓冲区中已存放的帧数
-static int phl_ready = 1;  // 物理层是否准备好接收数据
-static bool no_nak = true; // 是否禁止连续发送 NAK
+// --- 协议状态 ---
+// 每个站点一份, 原先是全局变量; 一个进程可以同时运行多条链路 (见 protocol.h 的 link_*())
+struct DATALINK
+{
+    seq_nr next_frame_to_send; // 发送方下一个要发送的帧序号
+    seq_nr ack_expected;       // 发送方下一个要确认的帧序号
+    seq_nr frame_expected;     // 接收方下一个要接收的帧序号
+    seq_nr too_far;            // 接收方下一个要接收的帧序号 (窗口上界)
+
+    unsigned char out_buf[NR_BUFS][PKT_LEN]; // 发送方缓冲区
+    struct FRAME *in_buf[NR_BUFS];           // 接收方缓冲区 (借用的帧, 交付后归还)
+    bool arrived[NR_BUFS];                   // 接收方缓冲区位图 (标记哪些槽已填充)
+
+    int nbuffered;  // 发送方缓冲区中已存放的帧数
+    int phl_ready;  // 物理层是否准备好接收数据
+    bool no_nak;    // 是否禁止连续发送 NAK
+};
 
-static void put_frame(unsigned char *frame, int len) // 发送帧到物理层
+static void put_frame(struct DATALINK *d, unsigned char *frame, int len) // 发送帧到物理层
 {
     *(unsigned int *)(frame + len) = crc32(frame, len);
     send_frame(frame, len + 4);
-    phl_ready = 0;
+    d->phl_ready = 0;
 }
 
 /* 发送数据帧 */
-static void send_data_frame(seq_nr frame_nr)
+static void send_data_frame(struct DATALINK *d, seq_nr frame_nr)
 {
     struct FRAME s;
     s.kind = FRAME_DATA;
     s.seq = frame_nr;
-    s.ack = (frame_expected + MAX_SEQ) % (MAX_SEQ + 1);   // 发送方下一个要确认的帧序号
-    memcpy(s.data, out_buf[frame_nr % NR_BUFS], PKT_LEN); // 将数据拷贝到帧中
+    s.ack = (d->frame_expected + MAX_SEQ) % (MAX_SEQ + 1);   // 发送方下一个要确认的帧序号
 
-    dbg_frame("发送 DATA %d %d, ID %d\n", s.seq, s.ack, *(short *)s.data);
-    put_frame((unsigned char *)&s, 3 + PKT_LEN);
+    dbg_frame("发送 DATA %d %d, ID %d\n", s.seq, s.ack, *(short *)d->out_buf[frame_nr % NR_BUFS]);
+    // 帧头与发送缓冲区中的数据分段交给物理层, 由其计算 CRC, 数据不再拷贝进帧
+    send_frame_iov((unsigned char *)&s, 3, d->out_buf[frame_nr % NR_BUFS], PKT_LEN);
+    d->phl_ready = 0;
     start_timer(frame_nr % NR_BUFS, DATA_TIMER); // 启动数据帧计时器
     stop_ack_timer();
 }
 
 /* 发送 ACK 帧 */
 // 与 send_data_frame 类似，但发送 ACK 帧时不需要携带数据，且序号字段未使用
-static void send_ack_frame(void)
+static void send_ack_frame(struct DATALINK *d)
 {
     struct FRAME s;
     s.kind = FRAME_ACK;
-    s.ack = (frame_expected + MAX_SEQ) % (MAX_SEQ + 1);
-    s.seq = next_frame_to_send;
+    s.ack = (d->frame_expected + MAX_SEQ) % (MAX_SEQ + 1);
+    s.seq = d->next_frame_to_send;
 
     dbg_frame("发送 ACK %d\n", s.ack);
-    put_frame((unsigned char *)&s, 2);
+    put_frame(d, (unsigned char *)&s, 2);
     stop_ack_timer();
 }
 
 /* 发送 NAK 帧 */
 // NAK与ACK类似，但ACK帧的ack字段是下一个要确认的帧序号，而NAK帧的ack字段是下一个要接收的帧序号
-static void send_nak_frame(void)
+static void send_nak_frame(struct DATALINK *d)
 {
     struct FRAME s;
     s.kind = FRAME_NAK;
 
-    s.ack = (frame_expected + MAX_SEQ) % (MAX_SEQ + 1);
+    s.ack = (d->frame_expected + MAX_SEQ) % (MAX_SEQ + 1);
     s.seq = 0; // seq 字段未使用
 
-    no_nak = false; // 抑制连续 NAK
+    d->no_nak = false; // 抑制连续 NAK
 
     dbg_frame("发送 NAK (ack=%d)\n", s.ack);
-    put_frame((unsigned char *)&s, 2); // NAK 帧长度为 2 (kind + ack)
+    put_frame(d, (unsigned char *)&s, 2); // NAK 帧长度为 2 (kind + ack)
     stop_ack_timer();
 }
 
-int main(int argc, char **argv)
+/* 初始化一个站点的协议状态 */
+static void datalink_init(struct DATALINK *d)
 {
-    int event;
-    seq_nr arg; // 接收帧
-    struct FRAME f;
-    int len = 0;
+    memset(d, 0, sizeof(*d));
+    d->too_far = NR_BUFS;
+    d->no_nak = true;
+}
 
-    protocol_init(argc, argv);
-    lprintf("SR-3, 构建时间: " __DATE__ "  " __TIME__ "\n");
+/* 处理 wait_for_event() 返回的一个事件 */
+static void datalink_event(struct DATALINK *d, int event, seq_nr arg)
+{
+    struct FRAME *f; // 借用物理层接收缓冲区中的帧, 不拷贝
+    int len = 0;
+    bool keep;
 
-    // 初始化
-    too_far = NR_BUFS;
-    nbuffered = 0;
-    phl_ready = 0;
-    no_nak = true;
-    memset(arrived, 0, sizeof(arrived));
+    switch (event)
+    {
+    case NETWORK_LAYER_READY:
+        if (d->nbuffered < NR_BUFS)
+        {
+            // 正常接收数据并存入发送缓冲区
+            get_packet(d->out_buf[d->next_frame_to_send % NR_BUFS]);
+            d->nbuffered++;
+            send_data_frame(d, d->next_frame_to_send);
+            inc(d->next_frame_to_send);
+        }
+        break;
 
-    disable_network_layer();
+    case PHYSICAL_LAYER_READY:
+        d->phl_ready = 1;
+        break;
 
-    for (;;)
-    {
-        // --- 修改: 将 wait_for_event 的参数解释为 seq_nr ---
-        event = wait_for_event((int *)&arg); // 强制类型转换，假设返回的是序号
+    case FRAME_RECEIVED:
+        f = (struct FRAME *)recv_frame_ref(&len);
+        keep = false;
 
-        switch (event)
+        if (len < 5 || crc32((unsigned char *)f, len) != 0)
         {
-        case NETWORK_LAYER_READY:
-            if (nbuffered < NR_BUFS)
+            dbg_event("**** CRC错误\n");
+            if (d->no_nak)
             {
-                // 正常接收数据并存入发送缓冲区
-                get_packet(out_buf[next_frame_to_send % NR_BUFS]);
-                nbuffered++;
-                send_data_frame(next_frame_to_send);
-                inc(next_frame_to_send);
+                // 校验错误且当前没有NAK时，发送NAK
+                send_nak_frame(d);
             }
+            release_frame((unsigned char *)f);
             break;
+        }
 
-        case PHYSICAL_LAYER_READY:
-            phl_ready = 1;
-            break;
-
-        case FRAME_RECEIVED:
-            len = recv_frame((unsigned char *)&f, sizeof f);
-
-            if (len < 5 || crc32((unsigned char *)&f, len) != 0)
+        if (f->kind == FRAME_DATA)
+        {
+            dbg_frame("收到 DATA %d %d, ID %d\n", f->seq, f->ack, *(short *)f->data);
+            dbg_frame("frame_expected = %d, too_far = %d\n", d->frame_expected, d->too_far);
+            // 非预期帧序列号时发送NAK
+            if (f->seq != d->frame_expected && d->no_nak)
             {
-                dbg_event("**** CRC错误\n");
-                if (no_nak)
-                {
-                    // 校验错误且当前没有NAK时，发送NAK
-                    send_nak_frame();
-                }
-                break;
+                send_nak_frame(d);
             }
-
-            if (f.kind == FRAME_DATA)
+            else
             {
-                dbg_frame("收到 DATA %d %d, ID %d\n", f.seq, f.ack, *(short *)f.data);
-                dbg_frame("frame_expected = %d, too_far = %d\n", frame_expected, too_far);
-                // 非预期帧序列号时发送NAK
-                if (f.seq != frame_expected && no_nak)
-                {
-                    send_nak_frame();
-                }
-                else
-                {
-                    // 收到预期帧时，停止ACK计时器
-                    start_ack_timer(ACK_TIMER);
-                }
+                // 收到预期帧时，停止ACK计时器
+                start_ack_timer(ACK_TIMER);
+            }
 
-                if (between(frame_expected, f.seq, too_far)) // 序号在窗口内
+            if (between(d->frame_expected, f->seq, d->too_far)) // 序号在窗口内
+            {
+                if (!d->arrived[f->seq % NR_BUFS]) // 窗口未满时
                 {
-                    if (!arrived[f.seq % NR_BUFS]) // 窗口未满时
-                    {
 
-                        arrived[f.seq % NR_BUFS] = true;
-                        memcpy(in_buf[f.seq % NR_BUFS], f.data, PKT_LEN);
+                    d->arrived[f->seq % NR_BUFS] = true;
+                    d->in_buf[f->seq % NR_BUFS] = f; // 暂存帧本身, 不拷贝数据
+                    keep = true;
 
-                        while (arrived[frame_expected % NR_BUFS])
-                        {
-                            // 按序提交网络层，因此实际上不是一并发送
-                            put_packet(in_buf[frame_expected % NR_BUFS], PKT_LEN);
-
-                            no_nak = true;
-                            arrived[frame_expected % NR_BUFS] = false;
-                            inc(frame_expected);
-                            inc(too_far);
-                            start_ack_timer(ACK_TIMER);
-                        }
-                    }
-                    else
+                    while (d->arrived[d->frame_expected % NR_BUFS])
                     {
-                        // 这里拆分了逻辑，在收到过ACK后直接重置时钟
-                        dbg_frame("DATA %d 已收到过\n", f.seq);
+                        // 按序提交网络层，因此实际上不是一并发送
+                        put_packet(d->in_buf[d->frame_expected % NR_BUFS]->data, PKT_LEN);
+                        if (d->in_buf[d->frame_expected % NR_BUFS] == f)
+                            keep = false; // 当前帧下面还要用, 最后再归还
+                        else
+                            release_frame((unsigned char *)d->in_buf[d->frame_expected % NR_BUFS]);
+
+                        d->no_nak = true;
+                        d->arrived[d->frame_expected % NR_BUFS] = false;
+                        inc(d->frame_expected);
+                        inc(d->too_far);
                         start_ack_timer(ACK_TIMER);
                     }
                 }
                 else
                 {
-                    // 再一次判断
-                    dbg_frame("DATA %d 在窗口外 [%d, %d)\n", f.seq, frame_expected, too_far);
+                    // 这里拆分了逻辑，在收到过ACK后直接重置时钟
+                    dbg_frame("DATA %d 已收到过\n", f->seq);
                     start_ack_timer(ACK_TIMER);
                 }
             }
-
-            // --- NAK 处理
-            if (f.kind == FRAME_NAK)
+            else
             {
-                seq_nr missing_seq = (f.ack + 1) % (MAX_SEQ + 1); // 从 ack 推断丢失帧
-                dbg_frame("收到 NAK (ack=%d), 推断丢失 %d\n", f.ack, missing_seq);
-
-                // 这里又进行判断重传帧是否在当前窗口
-                if (between(ack_expected, missing_seq, next_frame_to_send))
-                {
-                    dbg_frame("重传帧 %d (因 NAK)\n", missing_seq);
-                    send_data_frame(missing_seq);
-                }
-                else
-                {
-                    dbg_frame("推断丢失的帧 %d 不在窗口 [%d, %d) 内, 忽略 NAK\n", missing_seq, ack_expected, next_frame_to_send);
-                }
-                // break; // SR-2 没有 break，允许处理捎带确认
+                // 再一次判断
+                dbg_frame("DATA %d 在窗口外 [%d, %d)\n", f->seq, d->frame_expected, d->too_far);
+                start_ack_timer(ACK_TIMER);
             }
+        }
+
+        // --- NAK 处理
+        if (f->kind == FRAME_NAK)
+        {
+            seq_nr missing_seq = (f->ack + 1) % (MAX_SEQ + 1); // 从 ack 推断丢失帧
+            dbg_frame("收到 NAK (ack=%d), 推断丢失 %d\n", f->ack, missing_seq);
 
-            // 添加一个ACK接收的调试警告
-            if (f.kind == FRAME_ACK)
+            // 这里又进行判断重传帧是否在当前窗口
+            if (between(d->ack_expected, missing_seq, d->next_frame_to_send))
             {
-                dbg_frame("收到 ACK %d\n", f.ack);
+                dbg_frame("重传帧 %d (因 NAK)\n", missing_seq);
+                send_data_frame(d, missing_seq);
             }
-
-            // 处理确认信息
-            // 判断是否在当前窗口内，如果在窗口内，则滑动窗口
-            while (between(ack_expected, f.ack, next_frame_to_send))
+            else
             {
-                nbuffered--;
-                stop_timer(ack_expected % NR_BUFS);
-                inc(ack_expected);
+                dbg_frame("推断丢失的帧 %d 不在窗口 [%d, %d) 内, 忽略 NAK\n", missing_seq, d->ack_expected, d->next_frame_to_send);
             }
-            break;
+            // break; // SR-2 没有 break，允许处理捎带确认
+        }
 
-        // 主要修改了重传检测帧在不在当前窗口的逻辑
-        case DATA_TIMEOUT:
+        // 添加一个ACK接收的调试警告
+        if (f->kind == FRAME_ACK)
         {
-            dbg_event("---- DATA %d 超时 (来自 wait_for_event)\n", arg);
-            if (between(ack_expected, arg, next_frame_to_send))
-            {
-                dbg_event("---- 重传超时的帧 %d\n", arg);
-                send_data_frame(arg);
-            }
-            else
-            {
+            dbg_frame("收到 ACK %d\n", f->ack);
+        }
 
-                dbg_event("---- 超时帧 %d 不在当前窗口 [%d, %d) 内, 暂不重传\n", arg, ack_expected, next_frame_to_send);
-                send_data_frame(arg + NR_BUFS); // 这里是为了避免死循环，直接重传窗口外的帧
-            }
+        // 处理确认信息
+        // 判断是否在当前窗口内，如果在窗口内，则滑动窗口
+        while (between(d->ack_expected, f->ack, d->next_frame_to_send))
+        {
+            d->nbuffered--;
+            stop_timer(d->ack_expected % NR_BUFS);
+            inc(d->ack_expected);
         }
+
+        if (!keep)
+            release_frame((unsigned char *)f);
         break;
 
-        case ACK_TIMEOUT:
-            dbg_event("---- ACK超时\n");
-            send_ack_frame();
-            break;
+    // 主要修改了重传检测帧在不在当前窗口的逻辑
+    case DATA_TIMEOUT:
+    {
+        dbg_event("---- DATA %d 超时 (来自 wait_for_event)\n", arg);
+        if (between(d->ack_expected, arg, d->next_frame_to_send))
+        {
+            dbg_event("---- 重传超时的帧 %d\n", arg);
+            send_data_frame(d, arg);
         }
-
-        if (nbuffered < NR_BUFS && phl_ready)
-            enable_network_layer();
         else
-            disable_network_layer();
+        {
+
+            dbg_event("---- 超时帧 %d 不在当前窗口 [%d, %d) 内, 暂不重传\n", arg, d->ack_expected, d->next_frame_to_send);
+            send_data_frame(d, arg + NR_BUFS); // 这里是为了避免死循环，直接重传窗口外的帧
+        }
+    }
+    break;
+
+    case ACK_TIMEOUT:
+        dbg_event("---- ACK超时\n");
+        send_ack_frame(d);
+        break;
     }
-}
\ No newline at end of file
+
+    if (d->nbuffered < NR_BUFS && d->phl_ready)
+        enable_network_layer();
+    else
+        disable_network_layer();
+}
+
+/* --farm 模式: 每个站点一份 DATALINK, 由线程池轮流调度 */
+static void *datalink_open(struct station *l)
+{
+    struct DATALINK *d = (struct DATALINK *)malloc(sizeof(struct DATALINK));
+
+    (void)l; // 本站点已是当前站点
+    if (d == NULL)
+    {
+        lprintf("No enough memory\n");
+        exit(1);
+    }
+    datalink_init(d);
+    disable_network_layer();
+    return d;
+}
+
+static void datalink_farm_event(void *d, int event, int arg)
+{
+    datalink_event((struct DATALINK *)d, event, (seq_nr)arg);
+}
+
+int main(int argc, char **argv)
+{
+    struct DATALINK d; // --sim 模式下两个站点各自在自己的线程中运行 main(), 各有一份
+    int event, arg;
+
+    if (link_farm(argc, argv, datalink_open, datalink_farm_event))
+        return 0;
+
+    protocol_init(argc, argv);
+    lprintf("SR-3, 构建时间: " __DATE__ "  " __TIME__ "\n");
+
+    datalink_init(&d);
+    disable_network_layer();
+
+    for (;;)
+    {
+        event = wait_for_event(&arg);
+        datalink_event(&d, event, (seq_nr)arg);
+    }
+}
@@ -0,0 +1,892 @@
+#ifndef	_CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+/*
+   Channel emulator hub: N stations connect to it instead of to each other.
+   The topology file names the point-to-point links, one per line:
+
+       <name> <name> [<A to B>] [<B to A>] [@<medium>]
+
+   where a direction is given as with --ab, "bps=<bps>,delay=<ms>,ber=<ber>,
+   ge=<p>:<r>:<h>[:<k>]", or "-" for none; a single direction applies to
+   both. The first name plays station A. A station started with --hub and
+   one of the names waits here until the other end of its link comes, then
+   learns its role and the link's channel, and the hub relays the bytes of
+   the two like a direct TCP connection. The stations shape, delay and
+   corrupt what they exchange as before, so a station that is a node on
+   several links runs once per link, with a name for each.
+
+   Links with @<medium> share one channel, declared before them as
+
+       medium <name> bps=<bps>[,mac=aloha|csma][,cs=<ms>][,backoff=<slots>][,slot=<ms>][,lag=<ms>]
+
+   Every station of such links sends at the medium's rate, both ways of a
+   link included, and transmissions that overlap destroy each other. With
+   mac=csma a station defers while it hears another, until the medium
+   falls idle (1-persistent). A station hears a transmission cs ms after
+   it starts, so those that start closer together still collide, as do
+   those that waited for the same end. The station that has just sent
+   waits cs and a slot more, so one that deferred to it goes first, and
+   one whose frame collided one or two slots more at random, so two that
+   collided draw apart. With backoff=<n> a station that hears the medium
+   busy, or whose last frame collided, waits a random number of slots
+   instead, up to a limit that doubles from 2 with each such try and each
+   collision in a row, and n at most; the one that has just sent waits up
+   to n slots, so it has no edge over those. See medium_run() for how the
+   timing is kept.
+*/
+
+#ifdef _WIN32 /* for Windows Visual Studio */
+
+#define FD_SETSIZE 256
+#include <winsock.h>
+#include <stdio.h>
+#include "getopt.h"
+
+#define getopt_long getopt_int
+#define strnicmp _strnicmp
+#define would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define close_socket(s) closesocket(s)
+
+#pragma comment(lib,"wsock32.lib")
+
+#else /* for Linux */
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define strnicmp strncasecmp
+#define would_block() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#define close_socket(s) close(s)
+
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "lprintf.h"
+#include "hub.h"
+
+#define VERSION "1.1"
+#define DEFAULT_PORT 59144
+#define HUB_BUF (64 * 1024) /* bytes relayed at once */
+#define MAX_LINKS 1024
+#define MAX_MEDIA 64
+#define MEDIUM_SLACK 20000  /* us, a station sends a tick's worth at a time */
+#define MEDIUM_OPEN 0x7fffffffffffffffLL /* the end of a frame not come whole yet */
+
+#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+
+struct CONN;
+
+struct MEDIUM {
+    char name[HUB_NAME];
+    int bps;
+    int csma;                /* 0: pure ALOHA */
+    int backoff;             /* most slots a deferred station waits, 0: 1-persistent */
+    long long cs, slot, lag; /* us */
+    int active;              /* links up */
+
+    /* since the first link came up */
+    long long t0;            /* us */
+    long long frames, collided, deferred;
+    long long good_us, busy_us; /* air time of intact frames and of any */
+    long long good_bytes;    /* octets of intact frames, retransmissions included */
+    int on_air;              /* frames on the air now */
+    long long busy_since;    /* us, since on_air went up from 0 */
+};
+
+struct LINK {
+    char name[2][HUB_NAME];  /* 0 plays station A */
+    char dir[2][HUB_SPEC];   /* A to B, B to A */
+    struct MEDIUM *medium;   /* NULL: a channel of its own */
+    struct CONN *end[2];
+    long long bytes[2];      /* relayed from end i */
+    unsigned int up_ms;
+};
+
+/* A frame on a medium, the nibbles between the delimiters */
+struct FRAME {
+    struct FRAME *next;
+    long long ts;            /* us, when the first byte came */
+    long long start, end;    /* us, on the air, MEDIUM_OPEN till the frame is whole */
+    int on_air;
+    int whole;               /* the closing delimiter came */
+    int collided;
+    int len, size;
+    unsigned char *data;
+};
+
+/* A station's connection, its bytes wait in 'buf' till the peer takes them */
+struct CONN {
+    int sock;
+    struct LINK *link;       /* NULL: hello not complete */
+    int side;
+    int relay;               /* both ends are here */
+    unsigned char *buf;
+    int len, off, size;
+    struct CONN *next;
+
+    /* on a medium */
+    int setup;               /* bytes before the first frame, relayed as they are */
+    struct FRAME *rx;        /* being received */
+    struct FRAME *fq, *fq_tail; /* to send, the first may be on the air */
+    long long free_us;       /* the end of its last transmission */
+    long long sense_us;      /* when the first frame tries the medium, MEDIUM_OPEN: at the end of what it heard */
+    long long tried_us;      /* its last try that found the medium busy */
+    int tries;               /* busy tries of the first frame */
+    int streak;              /* frames collided in a row */
+};
+
+static struct MEDIUM media[MAX_MEDIA];
+static int nmedia;
+static struct LINK links[MAX_LINKS];
+static int nlinks;
+static struct CONN *conns;
+static unsigned short port = DEFAULT_PORT;
+
+/* Monotonic clock (us) */
+static long long hub_us(void)
+{
+    static long long t0 = -1;
+    long long us;
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    us = (long long)((double)now.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+    if (t0 < 0)
+        t0 = us;
+    return us - t0;
+}
+
+unsigned int get_ms(void)
+{
+    return (unsigned int)(hub_us() / 1000);
+}
+
+static void set_nonblock(int sock)
+{
+#ifdef _WIN32
+    u_long on = 1;
+
+    ioctlsocket(sock, FIONBIO, &on);
+#else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+static void *xrealloc(void *p, size_t n)
+{
+    if ((p = realloc(p, n)) == NULL)
+        ABORT("No enough memory");
+    return p;
+}
+
+/* Air time (us) of 'n' bytes on the wire, 4 bits each */
+#define air_us(m, n) ((n) * 4000000LL / (m)->bps)
+
+/* "bps=<bps>,mac=aloha|csma,cs=<ms>,backoff=<slots>,slot=<ms>,lag=<ms>", 0 if bad */
+static int medium_parse(struct MEDIUM *m, char *arg)
+{
+    char *p;
+    double v;
+
+    m->slot = m->lag = -1;
+    for (p = strtok(arg, ","); p; p = strtok(NULL, ",")) {
+        if (strnicmp(p, "mac=", 4) == 0) {
+            if (strnicmp(p + 4, "aloha", 5) != 0 && strnicmp(p + 4, "csma", 4) != 0)
+                return 0;
+            m->csma = tolower(p[4]) == 'c';
+            continue;
+        }
+        v = strchr(p, '=') ? strtod(strchr(p, '=') + 1, NULL) : -1;
+        if (v < 0)
+            return 0;
+        if (strnicmp(p, "bps=", 4) == 0)
+            m->bps = (int)v;
+        else if (strnicmp(p, "cs=", 3) == 0)
+            m->cs = (long long)(v * 1000);
+        else if (strnicmp(p, "backoff=", 8) == 0)
+            m->backoff = (int)v;
+        else if (strnicmp(p, "slot=", 5) == 0)
+            m->slot = (long long)(v * 1000);
+        else if (strnicmp(p, "lag=", 4) == 0)
+            m->lag = (long long)(v * 1000);
+        else
+            return 0;
+    }
+    if (m->bps < 100)
+        return 0;
+    if (m->slot <= 0)
+        m->slot = m->cs > 1000 ? m->cs : 1000;
+    if (m->lag < 0)
+        m->lag = MEDIUM_SLACK;
+    return 1;
+}
+
+/* Lines of links and media, '#' starts a comment */
+static void load_topology(const char *fname)
+{
+    char line[1024], *tok[5], *p;
+    struct MEDIUM *m;
+    struct LINK *l;
+    FILE *fp;
+    int n, i, j, k, lineno = 0;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        printf("Failed to open topology file \"%s\": %s\n", fname, strerror(errno));
+        exit(0);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        for (n = 0, p = strtok(line, " \t\r\n"); p && n < 5; p = strtok(NULL, " \t\r\n"))
+            tok[n++] = p;
+        if (n == 0)
+            continue;
+
+        if (strcmp(tok[0], "medium") == 0) {
+            if (n != 3 || nmedia == MAX_MEDIA || strlen(tok[1]) >= HUB_NAME) {
+                lprintf("Line %d of \"%s\": bad medium or too many media\n", lineno, fname);
+                exit(0);
+            }
+            m = &media[nmedia++];
+            strcpy(m->name, tok[1]);
+            if (!medium_parse(m, tok[2])) {
+                lprintf("Line %d of \"%s\": bad medium %s\n", lineno, fname, m->name);
+                exit(0);
+            }
+            lprintf("Medium %s: %d bps, %s, carrier sense %g ms, backoff %d slots of %g ms, lag %g ms\n",
+                m->name, m->bps, m->csma ? "CSMA" : "ALOHA", m->cs / 1000.0, m->backoff,
+                m->slot / 1000.0, m->lag / 1000.0);
+            continue;
+        }
+
+        if (n < 2 || nlinks == MAX_LINKS) {
+            lprintf("Line %d of \"%s\": bad link or too many links\n", lineno, fname);
+            exit(0);
+        }
+        l = &links[nlinks++];
+        if (tok[n - 1][0] == '@') {
+            for (m = media; m < media + nmedia && strcmp(m->name, tok[n - 1] + 1); m++)
+                ;
+            if (m == media + nmedia) {
+                lprintf("Line %d of \"%s\": no medium %s declared before\n", lineno, fname, tok[n - 1] + 1);
+                exit(0);
+            }
+            l->medium = m;
+            n--;
+        }
+        if (n > 4) {
+            lprintf("Line %d of \"%s\": bad link\n", lineno, fname);
+            exit(0);
+        }
+
+        for (i = 0; i < 2; i++) {
+            if (strlen(tok[i]) >= HUB_NAME) {
+                lprintf("Line %d of \"%s\": station name \"%s\" too long\n", lineno, fname, tok[i]);
+                exit(0);
+            }
+            strcpy(l->name[i], tok[i]);
+            for (j = 0; j < nlinks - 1; j++) {
+                for (k = 0; k < 2; k++) {
+                    if (strcmp(links[j].name[k], tok[i]) == 0) {
+                        lprintf("Line %d of \"%s\": station \"%s\" is on two links\n", lineno, fname, tok[i]);
+                        exit(0);
+                    }
+                }
+            }
+        }
+        if (strcmp(tok[0], tok[1]) == 0) {
+            lprintf("Line %d of \"%s\": a link joins two stations\n", lineno, fname);
+            exit(0);
+        }
+        for (i = 0; i < 2; i++) {
+            p = n > 2 + i ? tok[2 + i] : n > 2 ? tok[2] : "-";
+            if (strlen(p) >= HUB_SPEC - 16) {
+                lprintf("Line %d of \"%s\": channel \"%s\" too long\n", lineno, fname, p);
+                exit(0);
+            }
+            strcpy(l->dir[i], strcmp(p, "-") == 0 ? "" : p);
+            if (l->medium && (p = strstr(l->dir[i], "delay=")) != NULL && strtod(p + 6, NULL) * 1000 < l->medium->lag) {
+                lprintf("Line %d of \"%s\": medium %s lags %g ms, longer than the propagation delay\n",
+                    lineno, fname, l->medium->name, l->medium->lag / 1000.0);
+                exit(0);
+            }
+            if (l->medium) /* the medium's rate wins */
+                sprintf(l->dir[i] + strlen(l->dir[i]), "%sbps=%d", l->dir[i][0] ? "," : "", l->medium->bps);
+        }
+        lprintf("Link %s-%s: A->B %s, B->A %s%s%s\n", l->name[0], l->name[1],
+            l->dir[0][0] ? l->dir[0] : "as the stations say", l->dir[1][0] ? l->dir[1] : "as the stations say",
+            l->medium ? " on medium " : "", l->medium ? l->medium->name : "");
+    }
+    fclose(fp);
+    if (nlinks == 0)
+        ABORT("No link in the topology file");
+}
+
+static void medium_report(struct MEDIUM *m)
+{
+    long long now = hub_us() - m->lag, us = now - m->t0, busy = m->busy_us;
+
+    if (us <= 0 || m->frames == 0)
+        return;
+    if (m->on_air && m->busy_since < now) /* frames still on the air */
+        busy += now - m->busy_since;
+    lprintf("Medium %s: %lld frames, %lld collided (%.2f%%), %lld deferred, utilization %.2f%%, busy %.2f%%, throughput %.0f bps\n",
+        m->name, m->frames, m->collided, 100.0 * m->collided / m->frames, m->deferred,
+        100.0 * m->good_us / us, 100.0 * busy / us, m->good_bytes * 8 * 1e6 / us);
+}
+
+static void frame_free(struct FRAME *f)
+{
+    free(f->data);
+    free(f);
+}
+
+static void conn_close(struct CONN *c)
+{
+    struct CONN **pp;
+    struct FRAME *f;
+
+    for (pp = &conns; *pp != c; pp = &(*pp)->next)
+        ;
+    *pp = c->next;
+    close_socket(c->sock);
+    if (c->link && c->link->end[c->side] == c)
+        c->link->end[c->side] = NULL;
+    while ((f = c->fq) != NULL) {
+        c->fq = f->next;
+        frame_free(f);
+    }
+    if (c->rx && c->rx->len == 0) /* else it is in fq */
+        frame_free(c->rx);
+    free(c->buf);
+    free(c);
+}
+
+/* Either end of the link has gone, so has the link */
+static void link_down(struct LINK *l)
+{
+    int i;
+
+    if (l->end[0] && l->end[0]->relay) {
+        unsigned int secs = (get_ms() - l->up_ms) / 1000;
+        lprintf("Link %s-%s down after %u s, %lld bytes A->B, %lld bytes B->A\n",
+            l->name[0], l->name[1], secs, l->bytes[0], l->bytes[1]);
+        if (l->medium) {
+            medium_report(l->medium);
+            l->medium->active--;
+        }
+    }
+    for (i = 0; i < 2; i++)
+        if (l->end[i])
+            conn_close(l->end[i]);
+}
+
+/* The whole hello has come: find the station's link, start it if the peer is here; 0 if any connection closed */
+static int conn_hello(struct CONN *c)
+{
+    struct HUB_HELLO *hello = (struct HUB_HELLO *)c->buf;
+    struct HUB_REPLY reply;
+    struct MEDIUM *m;
+    struct LINK *l;
+    int i, side = -1;
+
+    hello->name[HUB_NAME - 1] = 0;
+    for (l = links; l < links + nlinks && side < 0; l++)
+        for (i = 0; i < 2; i++)
+            if (strcmp(l->name[i], hello->name) == 0) {
+                side = i;
+                break;
+            }
+    l--;
+
+    memset(&reply, 0, sizeof(reply));
+    if (hello->magic != HUB_MAGIC || side < 0 || l->end[side]) {
+        lprintf("Station \"%s\" refused: %s\n", hello->name,
+            hello->magic != HUB_MAGIC ? "not a station" : side < 0 ? "no link" : "already here");
+        send(c->sock, (char *)&reply, sizeof(reply), 0);
+        conn_close(c);
+        return 0;
+    }
+
+    c->link = l;
+    c->side = side;
+    c->len = 0;
+    l->end[side] = c;
+    lprintf("Station %s is here, %s\n", hello->name, l->end[!side] ? "link up" : "waiting for its peer");
+    if (l->end[!side] == NULL)
+        return 1;
+
+    /* a fresh socket has room for the reply */
+    m = l->medium;
+    for (i = 0; i < 2; i++) {
+        reply.role = 'a' + i;
+        strcpy(reply.peer, l->name[!i]);
+        memcpy(reply.dir, l->dir, sizeof(reply.dir));
+        reply.hold = m ? (int)m->lag : 0;
+        if (send(l->end[i]->sock, (char *)&reply, sizeof(reply), 0) != sizeof(reply)) {
+            link_down(l);
+            return 0;
+        }
+        l->end[i]->relay = 1;
+        l->end[i]->setup = m ? HUB_SETUP(reply.role) : 0;
+        set_nonblock(l->end[i]->sock);
+    }
+    if (m && m->active++ == 0) { /* a new run on the medium */
+        memset(&m->t0, 0, sizeof(*m) - ((char *)&m->t0 - (char *)m));
+        m->t0 = hub_us() - m->lag;
+    }
+    l->bytes[0] = l->bytes[1] = 0;
+    l->up_ms = get_ms();
+    return 1;
+}
+
+/* Queue 'n' bytes for the peer of 'c' */
+static void conn_put(struct CONN *c, const unsigned char *p, int n)
+{
+    if (c->off > 0 && c->off == c->len)
+        c->len = c->off = 0;
+    if (c->len + n > c->size) {
+        c->size = (c->len + n) * 2;
+        c->buf = (unsigned char *)xrealloc(c->buf, c->size);
+    }
+    memcpy(c->buf + c->len, p, n);
+    c->len += n;
+}
+
+/* Move what 'c' has sent on to its peer, 0 if the link is down */
+static int conn_flush(struct CONN *c)
+{
+    struct CONN *peer = c->link->end[!c->side];
+    int n;
+
+    while (c->off < c->len) {
+        n = send(peer->sock, (char *)c->buf + c->off, c->len - c->off, 0);
+        if (n < 0 && would_block())
+            return 1;
+        if (n <= 0)
+            return 0;
+        c->off += n;
+    }
+    c->len = c->off = 0;
+    return 1;
+}
+
+/* Carrier sense: the end of a transmission 'c' hears at 't', 0 if the medium is idle */
+static long long medium_busy(struct MEDIUM *m, struct CONN *c, long long t)
+{
+    struct CONN *o;
+    long long busy = 0;
+
+    for (o = conns; o; o = o->next) {
+        if (o == c || !o->relay || o->link->medium != m || !o->fq || !o->fq->on_air)
+            continue;
+        if (o->fq->start < t && o->fq->start <= t - m->cs && o->fq->end > t && o->fq->end > busy)
+            busy = o->fq->end;
+    }
+    return busy;
+}
+
+/* When the first frame of 'c' tries the medium: once it has come, after the gap behind the last one */
+static void medium_ready(struct MEDIUM *m, struct CONN *c)
+{
+    long long t = c->free_us, gap = m->backoff > 0 ? 1 + rand() % m->backoff : 1;
+
+    if (m->csma && t)
+        t += m->cs + gap * m->slot;
+
+    c->sense_us = c->fq->ts > t ? c->fq->ts : t;
+    c->tries = 0;
+}
+
+/* The closing delimiter of 'f' of 'c' came, so its end on the air is known */
+static void frame_whole(struct MEDIUM *m, struct CONN *c, struct FRAME *f)
+{
+    struct CONN *o;
+
+    f->whole = 1;
+    if (!f->on_air)
+        return;
+    f->end = f->start + air_us(m, f->len + 2);
+    for (o = conns; o; o = o->next) { /* those that heard it wait for that end */
+        if (o == c || !o->relay || o->link->medium != m || !o->fq || o->fq->on_air || o->sense_us != MEDIUM_OPEN)
+            continue;
+        if ((o->sense_us = medium_busy(m, o, o->tried_us)) == 0)
+            o->sense_us = o->tried_us;
+    }
+}
+
+/*
+   Split what a station on a medium sent into frames, the last of the 'n'
+   bytes came at 'us'. A frame is queued with its first bytes, so it may
+   go on the air before it is whole.
+*/
+static void conn_frames(struct CONN *c, const unsigned char *p, int n, long long us)
+{
+    const unsigned char *q, *end = p + n;
+    struct MEDIUM *m = c->link->medium;
+    struct FRAME *f;
+
+    while (p < end) {
+        q = (const unsigned char *)memchr(p, 0xff, end - p);
+        if (q == NULL)
+            q = end;
+        if ((f = c->rx) != NULL && q > p) {
+            if (f->len + (q - p) > f->size) {
+                f->size = (f->len + (int)(q - p)) * 2;
+                f->data = (unsigned char *)xrealloc(f->data, f->size);
+            }
+            if (f->len == 0) {
+                if (c->fq)
+                    c->fq_tail->next = f;
+                else {
+                    c->fq = f;
+                    medium_ready(m, c);
+                }
+                c->fq_tail = f;
+            }
+            memcpy(f->data + f->len, p, q - p);
+            f->len += (int)(q - p);
+        }
+        if ((p = q) == end)
+            break;
+
+        /* delimiter: the end of a frame or the start of the next */
+        if (c->rx && c->rx->len > 0) {
+            frame_whole(m, c, c->rx);
+            c->rx = NULL;
+        }
+        if (c->rx == NULL) {
+            c->rx = (struct FRAME *)calloc(1, sizeof(struct FRAME));
+            if (c->rx == NULL)
+                ABORT("No enough memory");
+        }
+        c->rx->ts = us - air_us(m, end - p); /* paced by the station at the medium's rate */
+        p++;
+    }
+}
+
+/* Returns 0 if 'c' is gone */
+static int conn_read(struct CONN *c)
+{
+    static unsigned char buf[HUB_BUF];
+    int n, raw;
+
+    if (!c->link) {
+        if (c->buf == NULL)
+            c->buf = (unsigned char *)xrealloc(NULL, c->size = sizeof(struct HUB_HELLO));
+        n = recv(c->sock, (char *)c->buf + c->len, sizeof(struct HUB_HELLO) - c->len, 0);
+        if (n <= 0) {
+            conn_close(c);
+            return 0;
+        }
+        if ((c->len += n) == sizeof(struct HUB_HELLO))
+            return conn_hello(c);
+        return 1;
+    }
+
+    n = recv(c->sock, (char *)buf, HUB_BUF, 0);
+    if (n < 0 && would_block())
+        return 1;
+    if (n <= 0 || !c->relay) { /* a waiting station has nothing to say */
+        link_down(c->link);
+        return 0;
+    }
+    c->link->bytes[c->side] += n;
+
+    raw = c->link->medium == NULL ? n : c->setup < n ? c->setup : n;
+    c->setup -= raw;
+    if (raw < n)
+        conn_frames(c, buf + raw, n - raw, hub_us());
+    if (raw > 0) {
+        conn_put(c, buf, raw);
+        if (!conn_flush(c)) {
+            link_down(c->link);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* 'c' starts sending its first frame at 't', destroying whatever it overlaps */
+static void medium_start(struct MEDIUM *m, struct CONN *c, long long t)
+{
+    struct FRAME *f = c->fq;
+    struct CONN *o;
+
+    f->on_air = 1;
+    f->start = t;
+    f->end = f->whole ? t + air_us(m, f->len + 2) : MEDIUM_OPEN;
+    for (o = conns; o; o = o->next) {
+        if (o == c || !o->relay || o->link->medium != m || !o->fq || !o->fq->on_air || o->fq->end <= t)
+            continue;
+        if (!o->fq->collided)
+            m->collided++;
+        if (!f->collided)
+            m->collided++;
+        o->fq->collided = f->collided = 1;
+    }
+
+    m->frames++;
+    if (c->tries > 0)
+        m->deferred++;
+    if (m->on_air++ == 0)
+        m->busy_since = t;
+}
+
+/* Random wait (us) before 'c' tries again, the limit doubles with each try and collision */
+static long long medium_backoff(struct MEDIUM *m, struct CONN *c)
+{
+    int n = c->tries + c->streak, slots;
+
+    slots = 2 << (n < 16 ? n - 1 : 15);
+    if (slots > m->backoff)
+        slots = m->backoff > 0 ? m->backoff : 2; /* 1-persistent, after a collision */
+    return (1 + rand() % slots) * m->slot;
+}
+
+/* The first frame of 'c' has been sent, pass it to the peer; 0 if the link is down */
+static int medium_end(struct MEDIUM *m, struct CONN *c)
+{
+    struct FRAME *f = c->fq;
+    static const unsigned char delim = 0xff;
+
+    if (f->collided)
+        f->data[f->len / 2] ^= 1; /* the CRC tells */
+    else {
+        m->good_us += f->end - f->start;
+        m->good_bytes += f->len / 2;
+    }
+    if (--m->on_air == 0)
+        m->busy_us += f->end - m->busy_since;
+    conn_put(c, &delim, 1);
+    conn_put(c, f->data, f->len);
+    conn_put(c, &delim, 1);
+
+    c->free_us = f->end;
+    c->streak = f->collided ? c->streak + 1 : 0;
+    if ((c->fq = f->next) != NULL) {
+        medium_ready(m, c);
+        if (c->streak)
+            c->sense_us += medium_backoff(m, c);
+    }
+    frame_free(f);
+    return conn_flush(c);
+}
+
+/*
+   The medium runs 'lag' behind the real time, as late as a station's bytes
+   may come: by then every frame that may have started has its first bytes
+   here and every one that may have ended its last, so overlaps and carrier
+   sense are exact while frames longer than the lag are still coming. A
+   frame starts when its station paced its first byte, or later if it
+   defers, and reaches the peer when it ends on the medium. The stations
+   take the lag off their propagation delay. Returns the real time (us) of
+   the next event, 0 if there is none before more bytes come.
+*/
+static long long medium_run(struct MEDIUM *m, long long now)
+{
+    struct CONN *c, *first;
+    long long t, tf, busy;
+
+    for (;;) {
+        first = NULL;
+        tf = 0;
+        for (c = conns; c; c = c->next) {
+            if (!c->relay || c->link->medium != m || !c->fq)
+                continue;
+            t = c->fq->on_air ? c->fq->end : c->sense_us;
+            if (first == NULL || t < tf || (t == tf && c->fq->on_air)) { /* ends before starts */
+                first = c;
+                tf = t;
+            }
+        }
+        if (first == NULL || tf == MEDIUM_OPEN)
+            return 0;
+        if (tf > now - m->lag)
+            return tf + m->lag;
+
+        c = first;
+        if (c->fq->on_air) {
+            if (!medium_end(m, c))
+                link_down(c->link);
+        } else if (m->csma && (busy = medium_busy(m, c, tf)) != 0) {
+            c->tries++;
+            c->tried_us = tf;
+            c->sense_us = m->backoff ? tf + medium_backoff(m, c) : busy;
+        } else
+            medium_start(m, c, tf);
+    }
+}
+
+static void hub_loop(int admin_sock)
+{
+    struct CONN *c, *next;
+    struct MEDIUM *m;
+    struct timeval tm;
+    fd_set rfd, wfd;
+    long long now, due, t;
+    int maxfd, sock, on = 1;
+
+    for (;;) {
+        now = hub_us();
+        due = 0;
+        for (m = media; m < media + nmedia; m++)
+            if (m->active && (t = medium_run(m, now)) != 0 && (due == 0 || t < due))
+                due = t;
+
+        FD_ZERO(&rfd);
+        FD_ZERO(&wfd);
+        FD_SET(admin_sock, &rfd);
+        maxfd = admin_sock;
+        for (c = conns; c; c = c->next) {
+            if (c->len > c->off && c->relay) /* the peer takes it first */
+                FD_SET(c->link->end[!c->side]->sock, &wfd);
+            if (c->len - c->off < HUB_BUF || !c->relay)
+                FD_SET(c->sock, &rfd);
+            if (c->sock > maxfd)
+                maxfd = c->sock;
+        }
+
+        fflush(stdout); /* the hub runs till it is killed */
+        if (log_file)
+            fflush(log_file);
+        if (due) {
+            t = due > now ? due - now : 0;
+            tm.tv_sec = (long)(t / 1000000);
+            tm.tv_usec = (long)(t % 1000000);
+        }
+        if (select(maxfd + 1, &rfd, &wfd, 0, due ? &tm : NULL) < 0) {
+#ifndef _WIN32
+            if (errno == EINTR)
+                continue;
+#endif
+            ABORT("system select()");
+        }
+
+        if (FD_ISSET(admin_sock, &rfd) && (sock = accept(admin_sock, 0, 0)) >= 0) {
+            if ((c = (struct CONN *)calloc(1, sizeof(struct CONN))) == NULL)
+                ABORT("No enough memory");
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+            c->sock = sock;
+            c->next = conns;
+            conns = c;
+        }
+
+        /* a link going down takes both ends, so start over after that */
+        for (c = conns; c; c = next) {
+            next = c->next;
+            if (c->len > c->off && c->relay && FD_ISSET(c->link->end[!c->side]->sock, &wfd) && !conn_flush(c)) {
+                link_down(c->link);
+                break;
+            }
+            if ((c->len - c->off < HUB_BUF || !c->relay) && FD_ISSET(c->sock, &rfd) && !conn_read(c))
+                break;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static struct option opts[] = {
+        { "help",  no_argument, NULL, '?' },
+        { "port",  required_argument, NULL, 'p' },
+        { "log",   required_argument, NULL, 'l' },
+        { "quiet", no_argument, NULL, 'q' },
+        { 0, 0, 0, 0 },
+    };
+    struct sockaddr_in name;
+    int admin_sock, opt, on = 1;
+
+    while ((opt = getopt_long(argc, argv, "?p:l:q", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            port = (unsigned short)atoi(optarg);
+            break;
+
+        case 'l':
+            if ((log_file = fopen(optarg, "w")) == NULL)
+                printf("WARNING: Failed to create log file \"%s\": %s\n", optarg, strerror(errno));
+            break;
+
+        case 'q':
+            log_quiet = 1;
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        printf("\nUsage:\n  %s <options> <topology-file>\n", argv[0]);
+        printf(
+            "\nOptions : \n"
+            "    -?, --help : print this\n"
+            "    -p, --port=<port#> : TCP port number (default: %u)\n"
+            "    -l, --log=<filename> : log file\n"
+            "    -q, --quiet : log to the log file only\n"
+            "\n"
+            "Each line of the topology file is a link, \"<name> <name> [<A to B>] [<B to A>] [@<medium>]\",\n"
+            "a direction as with --ab of the stations, \"-\" for none, or a shared medium,\n"
+            "\"medium <name> bps=<bps>[,mac=aloha|csma][,cs=<ms>][,backoff=<slots>][,slot=<ms>][,lag=<ms>]\".\n"
+            "The stations join with --hub=<host>[:<port>] <name>.\n"
+            "\n",
+            DEFAULT_PORT);
+        exit(0);
+    }
+
+    lprintf("Channel emulator hub, version %s\n", VERSION);
+    srand((unsigned int)time(NULL));
+    load_topology(argv[optind]);
+
+#ifdef _WIN32
+    {
+        WSADATA wsa;
+        WSAStartup(0x101, &wsa);
+    }
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (admin_sock < 0)
+        ABORT("Create TCP socket");
+    setsockopt(admin_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = INADDR_ANY;
+    name.sin_port = htons(port);
+    if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0)
+        ABORT("Failed to bind TCP port");
+    listen(admin_sock, 64);
+    lprintf("%d links, %d media, waiting for stations on TCP port %u\n", nlinks, nmedia, port);
+
+    hub_loop(admin_sock);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _HUB_H
+#define _HUB_H
+
+#include <time.h>
+
+/*
+   Handshake between a station and the channel emulator hub. The station
+   connects with --hub and says its name, the hub answers once the station
+   at the other end of the link has come too, and from then on it relays
+   the bytes of the two like a direct TCP connection.
+*/
+
+#define HUB_MAGIC 0x4855420b
+#define HUB_NAME  16  /* bytes of a station name, '\0' included */
+#define HUB_SPEC  128 /* bytes of a direction, as with --ab */
+
+struct HUB_HELLO {
+    unsigned int magic;
+    char name[HUB_NAME];
+};
+
+struct HUB_REPLY {
+    int role;               /* 'a' or 'b', 0: the hub has no link for the name */
+    char peer[HUB_NAME];
+    char dir[2][HUB_SPEC];  /* A to B and B to A as "bps=<bps>,delay=<ms>,...", "" if not given */
+    int hold;               /* us the hub holds each frame, taken off the propagation delay */
+};
+
+/* One direction of the channel, < 0: not given */
+struct chan {
+    int bps;
+    long long delay;     /* us */
+    double ber;
+    double ge_p, ge_r, ge_h, ge_k;
+};
+
+/* What a station tells its peer after the epoch, see chan_exchange() */
+struct chan_offer {
+    int set;             /* bit i: dir[i] given */
+    int shm;             /* asks for shared memory */
+    int bond;            /* channels it sends on, see --bond */
+    struct chan dir[2];
+};
+
+/* Bytes station 'role' sends through the hub before its first frame: B the epoch, both an offer */
+#define HUB_SETUP(role) ((int)(((role) == 'b' ? sizeof(time_t) : 0) + sizeof(struct chan_offer)))
+
+#endif
@@ -20,7 +20,8 @@
 
 #include "lprintf.h"
 
-FILE *log_file = NULL;
+LOG_LOCAL FILE *log_file = NULL;
+LOG_LOCAL int log_quiet = 0;
 
 #define bool int
 #define true 1
@@ -36,15 +37,16 @@ static unsigned long skip_to(const char *format) {
     return i;
 }
 
-#define tee_output(buf, len) do { \
-    fwrite(buf, 1, len, stdout); \
-	if (log_file)                    \
+#define tee_output(buf, len) do {   \
+    if (!log_quiet)                    \
+        fwrite(buf, 1, len, stdout);   \
+    if (log_file)                      \
         fwrite(buf, 1, len, log_file); \
 } while (0)
 
 static int output(const char *str, int len)
 {
-	static bool sol = true; /* start of line */
+	static LOG_LOCAL bool sol = true; /* start of line */
 	unsigned int ms, n;
 	char timestamp[32];
 	const char *head, *tail, *end = str + len;
@@ -8,7 +8,15 @@ extern "C"
 #include <stdarg.h>
 #include <stdio.h>
 
-extern FILE *log_file;
+/* Per thread, so that stations run by different threads keep their logs apart */
+#ifdef _MSC_VER
+#define LOG_LOCAL __declspec(thread)
+#else
+#define LOG_LOCAL __thread
+#endif
+
+extern LOG_LOCAL FILE *log_file;
+extern LOG_LOCAL int log_quiet; /* log file only, no copy on stdout */
 extern unsigned int get_ms(void);
 
 int lprintf(const char *format, ...);
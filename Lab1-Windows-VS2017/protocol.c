@@ -2,21 +2,63 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <time.h>
 
 static time_t epoch; /* epoch timestamp (be same for Station A & B) */
+static long long clock_base; /* monotonic clock reading (ns) at the epoch */
+static long long virtual_ns = -1; /* virtual clock (ns) of a simulation, -1: real time */
 
 #ifdef _WIN32 /* for Windows Visual Studio */
 
 #include <winsock.h>
 #include <io.h>
 #include <stdio.h>
+#include <process.h>
 #include <sys/types.h>
 #include <sys/timeb.h>
 #include "getopt.h"
 
 #define getopt_long getopt_int
 #define stricmp _stricmp
+#define strnicmp _strnicmp
+
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define mutex_init(m)     InitializeCriticalSection(m)
+#define mutex_lock(m)     EnterCriticalSection(m)
+#define mutex_unlock(m)   LeaveCriticalSection(m)
+#define cond_init(c)      InitializeConditionVariable(c)
+#define cond_wait(c, m)   SleepConditionVariableCS(c, m, INFINITE)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define cond_timedwait(c, m, us) SleepConditionVariableCS(c, m, (DWORD)(((us) + 999) / 1000))
+
+#define ATOMIC_LOAD(p)     (*(volatile int *)(p))
+#define ATOMIC_STORE(p, v) (*(volatile int *)(p) = (v))
+#define ATOMIC_FENCE()     MemoryBarrier()
+#define cpu_relax()        YieldProcessor()
+#define HAVE_SHM
+
+#define THREAD_PROC(name) static unsigned __stdcall name(void *arg)
+
+static void thread_create(unsigned (__stdcall *proc)(void *), void *arg)
+{
+    if (_beginthreadex(NULL, 0, proc, arg, 0, NULL) == 0) {
+        printf("Failed to create thread\n");
+        exit(0);
+    }
+}
+
+static int cpu_count(void)
+{
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+}
 
 static void socket_init(void)
 {
@@ -32,19 +74,35 @@ static void socket_init(void)
     }
 }
 
-unsigned int get_ms(void)
+/* Monotonic clock (ns) */
+static long long mono_ns(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER cnt;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+
+	return cnt.QuadPart / freq.QuadPart * 1000000000 
+		+ cnt.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart;
+}
+
+/* Wall clock (ns) since the epoch */
+static long long wall_ns(void)
 {
 	struct _timeb tm;
 
 	_ftime(&tm);
 
-	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
+	return ((long long)(tm.time - epoch) * 1000 + tm.millitm) * 1000000;
 }
 
 #pragma comment(lib,"wsock32.lib")
 
 #else /* for Linux */
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -56,34 +114,143 @@ unsigned int get_ms(void)
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING
+#endif
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#define HAVE_SHM
+#endif
 #define stricmp strcasecmp
+#define strnicmp strncasecmp
 #define Sleep(ms) usleep((ms) * 1000)
 #define socket_init()
 
-unsigned int get_ms(void)
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define mutex_init(m)     pthread_mutex_init(m, NULL)
+#define mutex_lock(m)     pthread_mutex_lock(m)
+#define mutex_unlock(m)   pthread_mutex_unlock(m)
+#define cond_init(c)      pthread_cond_init(c, NULL)
+#define cond_wait(c, m)   pthread_cond_wait(c, m)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+
+static void cond_timedwait(cond_t *c, mutex_t *m, long long us)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += us % 1000000 * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(c, m, &ts);
+}
+
+#define ATOMIC_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_FENCE()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()        __builtin_ia32_pause()
+#else
+#define cpu_relax()        __asm__ __volatile__("" ::: "memory")
+#endif
+
+#define THREAD_PROC(name) static void *name(void *arg)
+
+static void thread_create(void *(*proc)(void *), void *arg)
+{
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, proc, arg) != 0) {
+        printf("Failed to create thread\n");
+        exit(0);
+    }
+    pthread_detach(tid);
+}
+
+static int cpu_count(void)
+{
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Monotonic clock (ns) */
+static long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Wall clock (ns) since the epoch */
+static long long wall_ns(void)
 {
 	struct timeval tm;
-	struct timezone tz;
 
-	gettimeofday(&tm, &tz);
+	gettimeofday(&tm, NULL);
 
-	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
+	return ((long long)(tm.tv_sec - epoch) * 1000000 + tm.tv_usec) * 1000;
 }
 
 #endif
 
+/* Align the monotonic clock with the epoch shared by both stations */
+static void clock_init(void)
+{
+	clock_base = mono_ns() - wall_ns();
+}
+
+long long get_ns(void)
+{
+	if (virtual_ns >= 0)
+		return virtual_ns;
+	return epoch ? mono_ns() - clock_base : 0;
+}
+
+long long get_us(void)
+{
+	return get_ns() / 1000;
+}
+
+unsigned int get_ms(void)
+{
+	return (unsigned int)(get_ns() / 1000000);
+}
+
 #include <math.h>
+#include <stddef.h>
 
-#include "protocol.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
-/* channel parameters */
-#define CHAN_DELAY 270       /* ms */
-#define CHAN_BPS   8000      /* bits per second */
+#include "protocol.h"
+#include "hub.h"
 
 #define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
 
 #define DEFAULT_TICK 15 /* ms */
 #define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
+#define DEFAULT_CHAN_BPS   8000      /* bits per second */
+#define DEFAULT_CHAN_DELAY 270       /* ms */
 #define DEFAULT_PORT  59144
 
 #define NMAGIC     32
@@ -92,28 +259,290 @@ unsigned int get_ms(void)
 
 static void magic_init(void);
 static void magic_check(void);
+static void phl_thread_start(void);
+static void pools_init(void);
+static void em_init(void);
+static void trace_init(void);
 
 static unsigned int head_magic[NMAGIC];
 
-/* Parameters */
-static int station;
-static double ber = DEFAULT_CHAN_BER;  /* Bit Error Rate */
-static int mode_ibib = 0;    /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
-static int mode_flood = 0;   /* flood mode */
-static int mode_cycle = 100;  /* seconds */
-static int mode_life = 0x7fffff00;
-static int mode_tick = DEFAULT_TICK;
-static int mode_seed = 0x098bcde1;
-static int debug_mask = 0; /* debug mask */
-static unsigned short port = DEFAULT_PORT;
-
-static int sock;
-static int now; /* timestamp (ms) */
-static int noise = 0; /* counter of bit errors */
+
+/* Per-station state */
+
+/* limits of the sizes derived from the channel rate */
+#define SQ_SEG_MIN (16 * 1024)
+#define SQ_SEG_MAX (1024 * 1024)
+#define SQ_MAX   (32 * 1024 * 1024)
+#define BLK_MIN  16
+#define BLK_MAX  (1024 * 1024)
+#define SOCKBUF_MIN (64 * 1024)
+#define SOCKBUF_MAX (16 * 1024 * 1024)
+#define RECV_BURST 16 /* blocks read from the socket in a row */
+#define PHL_SQ_LEVEL  50 /* at least */
+#define RFQ_SIZE 256 /* received frames not yet taken by recv_frame() */
+
+#define NTIMER 4097
+#define ACK_TIMER_ID (NTIMER - 1)
+
+#define TW_TICK_US 100
+#define TW0_BITS 8
+#define TW_BITS  6
+#define TW0_SIZE (1 << TW0_BITS)
+#define TW_SIZE  (1 << TW_BITS)
+#define TW0_MASK (TW0_SIZE - 1)
+#define TW_MASK  (TW_SIZE - 1)
+#define TW1_SHIFT TW0_BITS
+#define TW2_SHIFT (TW0_BITS + TW_BITS)
+
+/* Free-list pool of fixed-size objects, see pool_get() */
+#define POOL_RET 512
+
+struct POOL {
+    int size;                   /* bytes per object */
+    void *free;                 /* linked through the first word of each object */
+    void *ret[POOL_RET];        /* objects given back by the other thread */
+    int ret_head, ret_tail;
+    void *over;                 /* given back while the ring was full, kept by the other thread */
+    int gets, heap;             /* objects taken, of which from the heap */
+};
+
+static void *pool_get(struct POOL *p);
+static void pool_return(struct POOL *p, void *obj);
+
+/*
+   Bonded channels: a station may send on up to BOND_MAX channels of the
+   same rate and delay. Each has a sending queue and a token bucket of its
+   own and send_frame() puts a frame on the one its policy chooses. The
+   channels share the byte stream to the peer: BOND_SWITCH + i says that
+   channel i's bytes follow, and every frame starts with a 16-bit sequence
+   number in BOND_HDR bytes of BOND_SEQ + nibble, which the receiver uses
+   to pass the frames on in the order they were sent. The error model
+   spares both like the delimiters.
+*/
+#define BOND_MAX    8
+#define BOND_SWITCH 0xf0
+#define BOND_SEQ    0x10
+#define BOND_HDR    4
+#define BOND_WIN    4096 /* frames the receiver holds back at most */
+
+struct SQCHAN {
+    struct SQSEG *first, *last; /* last/in are moved by the protocol, first/out by the physical layer */
+    int rptr, wptr;      /* in first and last */
+    unsigned int in, out; /* bytes queued and sent so far */
+    long long send_ts;   /* last refill (us) of the token bucket */
+    long long tb_credit; /* token bucket, TB_BYTE per byte */
+    int tb_idle;         /* the queue was empty after the last send */
+    long long frames;    /* queued on this channel */
+};
+
+struct bond_policy {
+    const char *name;
+    int (*next)(void);   /* channel for the next frame */
+};
+
+static int bond_rr(void);
+static int bond_lq(void);
+static const struct bond_policy bond_policies[] = {
+    { "rr", bond_rr },
+    { "lq", bond_lq },
+    { NULL, NULL },
+};
+
+struct TIMER {
+    long long expire;           /* tick, 0: not running */
+    int queued;                 /* 0: none, 1: wheel, 2: expired list */
+    struct TIMER *prev, *next;
+};
+
+/* Byte stream between the stations */
+struct transport {
+    int  (*send)(const unsigned char *buf, int len); /* < 0: disconnected, 0: no room */
+    int  (*sendv)(const unsigned char *buf1, int len1, const unsigned char *buf2, int len2); /* NULL: two send() */
+    int  (*recv)(unsigned char *buf, int size, long long *ts); /* ts: arrival (us) */
+    int  (*poll)(void);                              /* PHL_READABLE | PHL_WRITABLE */
+    void (*wait)(long long us);                      /* until readable or timeout */
+};
+
+#define PHL_READABLE 1
+#define PHL_WRITABLE 2
+
+struct station {
+    /* parameters */
+    int station;
+    char name[HUB_NAME]; /* given with --hub, any name the hub knows */
+    char hub[64];        /* <host>[:<port>] of the hub, "" for none */
+    long long hub_hold;  /* us the hub holds each frame, part of the propagation delay */
+    int chan_bps;        /* bits per second, sending */
+    long long chan_delay; /* propagation delay (us), receiving */
+    double ber;          /* Bit Error Rate, receiving */
+    double ge_p, ge_r, ge_h, ge_k; /* Gilbert-Elliott: G->B, B->G, error rate in B and G */
+    int rx_bps;          /* bits per second, receiving */
+    struct chan dir[2];  /* 0: A to B, 1: B to A */
+    int dir_set;         /* bit i: dir[i] given on the command line */
+    int mode_ibib;       /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
+    int mode_flood;      /* flood mode */
+    int mode_cycle;      /* seconds */
+    int mode_life;
+    int mode_tick;
+    int mode_tickless;   /* block until the next deadline instead of ticking */
+    int mode_seed;
+    int debug_mask;      /* debug mask */
+    unsigned short port;
+    int mode_sim;        /* both stations in one process on a virtual clock */
+    int mode_thread;     /* physical layer on its own thread */
+    int mode_uring;      /* io_uring instead of socket calls */
+    int mode_shm;        /* shared memory instead of the TCP connection */
+    int peer_shm;        /* the peer station asks for it too */
+    int mode_quiet;      /* log file only */
+    int linked;          /* joined to its peer by link_pair() */
+    int quit;            /* linked: 1, life over or peer gone; 2, reported */
+    FILE *log;
+
+    const struct transport *tp;
+    struct URING *uring; /* io_uring state of the socket */
+    struct SHMS *shm;    /* shared memory rings */
+    int sock;
+    long long now_us;    /* timestamp (us) */
+    int now;             /* timestamp (ms) */
+    int noise;           /* counter of bit errors */
+    const struct errmodel *em; /* NULL: error-free channel */
+    unsigned long long rng[4]; /* xoshiro256** state */
+    long long em_skip;   /* data bits before the next error */
+    double em_ln[4];     /* 1 / ln(1 - x) of ber or of ge_p, ge_r, ge_h, ge_k */
+    int ge_bad;          /* Gilbert-Elliott state */
+    long long ge_left;   /* bits left in the state */
+
+    /* impairments of the received frames, see imp_frame() */
+    int imp_on;
+    double imp_loss, imp_dup, imp_reorder; /* probabilities per frame */
+    long long imp_gap;   /* us a reordered frame is held back */
+    long long imp_jitter; /* us, the delay varies by this much */
+    long long imp_base;  /* part of the delay left to the jitter */
+    int imp_normal;      /* normal instead of uniform jitter */
+    struct RCV_FRAME *imp_held; /* frames held back, by release time */
+    int imp_frames, imp_lost, imp_dups, imp_reordered, imp_delayed;
+
+    /* channel trace, see trace_step() */
+    FILE *trace;         /* NULL: no more entries */
+    long long trace_ts;  /* us, when the pending entry applies */
+    int tr_bps;          /* pending entry, < 0: unchanged */
+    long long tr_delay;
+    double tr_ber;
+    long long phl_us;    /* timestamp (us) of the physical layer */
+
+    /* physical layer sender, one queue and token bucket per bonded channel */
+    struct SQCHAN sq[BOND_MAX];
+    int bond;            /* channels sent on, see bond_policies[] */
+    int bond_policy;     /* in bond_policies[] */
+    int bond_cur;        /* channel of the frame being queued */
+    int bond_tx;         /* channel of the last bytes sent */
+    int bond_rr;         /* next channel of the round robin */
+    unsigned int bond_seq; /* sequence number of the next frame */
+    int sq_seg;          /* bytes per segment */
+    struct POOL sq_pool;
+    int sq_level;        /* PHYSICAL_LAYER_READY below this once over sq_high */
+    int sq_high;         /* high-water mark */
+    int sq_full;         /* sq_high reached, wait for sq_level */
+    int sq_peak;
+    int inform_phl_ready;
+    int send_chunk;      /* flush unit: bytes written at once while backlogged, a tick's worth */
+    int tb_burst;        /* bytes sent at once after the queue has been empty */
+    int tb_burst_opt;    /* given with -B, 0: a millisecond's worth */
+    int sq_flush;        /* frames queued for the quota left, sent by sq_flush() */
+    long long tx_frames, tx_calls, tx_saved; /* frames sent, send calls made and saved by writing together */
+    long long tx_bytes;  /* written to the channel */
+
+    /* physical layer receiver */
+    struct BLK *rblk_head, *rblk_tail;
+    int blksize;
+    long long blk_delay; /* us from arrival to commit */
+    long long nbits;
+    struct RCV_FRAME *rf_buf;
+    int rx_bond;         /* channels the peer sends on */
+    int bond_rx;         /* channel of the bytes being decoded */
+    struct RCV_FRAME *bond_rf[BOND_MAX]; /* frames being received on the other channels */
+    struct RCV_FRAME **bond_held; /* BOND_WIN frames put in sequence, see bond_frame() */
+    unsigned int bond_next; /* sequence number of the next frame passed on */
+    int bond_ahead;      /* frames held back for one sent before them */
+    int bond_late;       /* frames outside the window, passed on at once */
+    int bond_count, bond_peak; /* frames held back, most of them */
+    struct POOL blk_pool, rf_small, rf_large;
+    struct RCV_FRAME *rfq[RFQ_SIZE]; /* rfq_tail is moved by the physical layer, rfq_head by the protocol */
+    int rfq_head, rfq_tail;
+
+    /* wakeup of the protocol thread by the physical layer thread */
+    mutex_t phl_lock;
+    cond_t phl_cond;
+    int phl_wake;
+
+    /* timers */
+    struct TIMER timer[NTIMER];
+    struct TIMER tw0[TW0_SIZE], tw1[TW_SIZE], tw2[TW_SIZE];
+    struct TIMER expired;     /* expired but not yet reported */
+    unsigned int tw0_map[TW0_SIZE / 32]; /* non-empty level 0 slots */
+    long long tw_ts;          /* all timers up to this tick are in 'expired' */
+    int tw_pending;           /* timers in the wheel */
+
+    /* network layer */
+    int network_layer_active;
+    long long network_ts; /* time (us) of the last NETWORK_LAYER_READY */
+    int layer3_ready;
+    int rpackets;
+    long long rbytes;
+    int pkt_no;
+    int report_ts;
+    int ts0;
+    unsigned int rand_a, rand_b;
+};
+
+static STATION_LOCAL struct station *st; /* station run by this thread */
+
+/* Make 's' the station of this thread, its log included */
+static void station_select(struct station *s)
+{
+    st = s;
+    log_file = s->log;
+    log_quiet = s->mode_quiet;
+}
+
+static struct station *station_new(void)
+{
+    struct station *s;
+    int i;
+
+    s = (struct station *)calloc(1, sizeof(struct station));
+    if (s == NULL) {
+        printf("No enough memory\n");
+        exit(0);
+    }
+
+    s->ber = DEFAULT_CHAN_BER;
+    s->chan_bps = DEFAULT_CHAN_BPS;
+    s->chan_delay = DEFAULT_CHAN_DELAY * 1000LL;
+    for (i = 0; i < 2; i++) {
+        s->dir[i].bps = -1;
+        s->dir[i].delay = -1;
+        s->dir[i].ber = -1.0;
+        s->dir[i].ge_p = -1.0;
+    }
+    s->mode_cycle = 100;
+    s->mode_life = 0x7fffff00;
+    s->mode_tick = DEFAULT_TICK;
+    s->mode_seed = 0x098bcde1;
+    s->port = DEFAULT_PORT;
+    s->inform_phl_ready = 1;
+    s->bond = s->rx_bond = 1;
+    s->rand_a = 0x65109bc4;
+    s->rand_b = 0x1e459090;
+
+    return s;
+}
 
 char *station_name(void)
 {
-    return (char *)(station == 'a' ? "A" : station == 'b' ? "B" : "XXX");
+    if (st->name[0])
+        return st->name;
+    return (char *)(st->station == 'a' ? "A" : st->station == 'b' ? "B" : "XXX");
 }
 
 static struct option intopts[] = {
@@ -122,15 +551,86 @@ static struct option intopts[] = {
 	{ "flood",	no_argument, NULL, 'f' },
 	{ "ibib",	no_argument, NULL, 'i' },
 	{ "nolog",  no_argument, NULL, 'n' },
+	{ "tickless", no_argument, NULL, 'k' },
+	{ "sim",    no_argument, NULL, 's' },
+	{ "thread", no_argument, NULL, 'T' },
+	{ "uring",  no_argument, NULL, 'U' },
+	{ "shm",    no_argument, NULL, 'm' },
 	{ "debug",	required_argument, NULL, 'd' },
 	{ "port",	required_argument, NULL, 'p' },
 	{ "ber",	required_argument, NULL, 'b' },
+	{ "ge",		required_argument, NULL, 'g' },
+	{ "loss",	required_argument, NULL, 'L' },
+	{ "dup",	required_argument, NULL, 'D' },
+	{ "reorder",	required_argument, NULL, 'R' },
+	{ "jitter",	required_argument, NULL, 'J' },
+	{ "bps",	required_argument, NULL, 'r' },
+	{ "ab",		required_argument, NULL, 'w' },
+	{ "ba",		required_argument, NULL, 'W' },
+	{ "delay",	required_argument, NULL, 'y' },
+	{ "burst",	required_argument, NULL, 'B' },
+	{ "sq-high",	required_argument, NULL, 'H' },
+	{ "trace",	required_argument, NULL, 'C' },
 	{ "log",	required_argument, NULL, 'l' },
+	{ "quiet",  no_argument, NULL, 'q' },
+	{ "farm",   required_argument, NULL, 'F' },
+	{ "hub",    required_argument, NULL, 'j' },
+	{ "bond",   required_argument, NULL, 'K' },
 	{ "ttl",    required_argument, NULL, 't' },
 	{ 0, 0, 0, 0 },
 };
 
-#define OPT_SHORT "?ufind:p:b:l:t:"
+#define OPT_SHORT "?ufinksTUmqd:F:j:K:p:b:g:L:D:R:J:r:w:W:y:B:H:C:l:t:"
+
+/* "bps=<bps>,delay=<ms>,ber=<ber>,ge=<p>:<r>:<h>[:<k>]", any subset */
+static int chan_parse(struct chan *c, const char *arg)
+{
+    char buf[256], *tok;
+    double v;
+
+    strncpy(buf, arg, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        if (strnicmp(tok, "ge=", 3) == 0) {
+            c->ge_k = 0.0;
+            if (sscanf(tok + 3, "%lf:%lf:%lf:%lf", &c->ge_p, &c->ge_r, &c->ge_h, &c->ge_k) < 3
+                || c->ge_p <= 0.0 || c->ge_p >= 1.0 || c->ge_r <= 0.0 || c->ge_r >= 1.0
+                || c->ge_h < 0.0 || c->ge_h >= 1.0 || c->ge_k < 0.0 || c->ge_k >= 1.0)
+                return 0;
+        } else if (strnicmp(tok, "bps=", 4) == 0 && (v = strtod(tok + 4, 0)) >= 100 && v <= 2.0E9)
+            c->bps = (int)v;
+        else if (strnicmp(tok, "delay=", 6) == 0 && (v = strtod(tok + 6, 0)) >= 0)
+            c->delay = (long long)(v * 1000);
+        else if (strnicmp(tok, "ber=", 4) == 0 && (v = strtod(tok + 4, 0)) >= 0 && v < 1.0)
+            c->ber = v;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+static void chan_log(const char *name, const struct chan *c)
+{
+	lprintf("%s: %d bps, %g ms propagation delay, bit error rate ", name, c->bps, c->delay / 1000.0);
+	if (c->ge_p > 0.0)
+		lprintf("%.1E (Gilbert-Elliott p %.1E, r %.1E, h %.1E, k %.1E)\n",
+			(c->ge_p * c->ge_h + c->ge_r * c->ge_k) / (c->ge_p + c->ge_r), c->ge_p, c->ge_r, c->ge_h, c->ge_k);
+	else if (c->ber > 0.0)
+		lprintf("%.1E\n", c->ber);
+	else
+		lprintf("0\n");
+}
+
+/* "x.log" becomes "x<suffix>.log", for stations given the same -l */
+static void log_suffix(char *fname, const char *suffix)
+{
+	char ext[1024], *dot = strrchr(fname, '.');
+
+	if (dot == NULL || strpbrk(dot, "/\\"))
+		dot = fname + strlen(fname);
+	strcpy(ext, dot);
+	sprintf(dot, "%s%s", suffix, ext);
+}
 
 static void config(int argc, char **argv)
 {
@@ -140,6 +640,7 @@ static void config(int argc, char **argv)
 	if (argc < 2) {
 	usage:
 		printf("\nUsage:\n  %s <options> <station-name>\n", argv[0]);
+		printf("  %s <options> --hub=<host>[:<port>] <name>\n", argv[0]);
 		printf(
 			"\nOptions : \n"
 			"    -?, --help : print this\n"
@@ -147,17 +648,43 @@ static void config(int argc, char **argv)
 			"    -f, --flood : flood traffic\n"
 			"    -i, --ibib  : set station B layer 3 sender mode as IDLE-BUSY-IDLE-BUSY-...\n"
 			"    -n, --nolog : do not create log file\n"
+			"    -k, --tickless : sleep until the next event instead of polling every %d ms\n"
+			"    -s, --sim : run both stations in this process on a virtual clock\n"
+			"    -T, --thread : run the physical layer on its own thread\n"
+			"    -U, --uring : use io_uring for the TCP connection (Linux)\n"
+			"    -m, --shm : exchange data through shared memory, both stations on one host\n"
 			"    -d, --debug=<0-7>: debug mask (bit0:event, bit1:frame, bit2:warning)\n"
 			"    -p, --port=<port#> : TCP port number (default: %u)\n"
 			"    -b, --ber=<ber> : Bit Error Rate (received data only)\n"
+			"    -g, --ge=<p>,<r>,<h>[,<k>] : Gilbert-Elliott burst errors instead of --ber, per bit\n"
+			"        p: good to bad, r: bad to good, h/k: error rate in the bad/good state\n"
+			"    -L, --loss=<p> : drop received frames with probability p\n"
+			"    -D, --dup=<p> : duplicate received frames with probability p\n"
+			"    -R, --reorder=<p>[,<ms>] : hold back received frames with probability p (default: 10 ms)\n"
+			"    -J, --jitter=<ms>[,normal] : vary the delay of received frames, uniform or normal\n"
+			"    -r, --bps=<bps> : channel bit rate (default: %d)\n"
+			"    -y, --delay=<ms> : propagation delay (default: %d)\n"
+			"    -w, --ab=<key>=<value>,... : A to B direction, keys bps, delay (ms), ber, ge (p:r:h[:k])\n"
+			"    -W, --ba=<key>=<value>,... : B to A direction, the other parameters apply otherwise\n"
+			"    -B, --burst=<bytes> : bytes sent at once by an idle channel (default: 1 ms worth)\n"
+			"    -H, --sq-high=<bytes> : high-water mark of the sending queue (of each bonded channel), see phl_sq_len()\n"
+			"    -C, --trace=<filename> : channel trace, lines of \"<ms> [bps=<bps>] [delay=<ms>] [ber=<ber>]\"\n"
 			"    -l, --log=<filename> : using assigned file as log file\n"
+			"    -q, --quiet : log to the log file only\n"
+			"    -F, --farm=<pairs>[,<threads>[,<file>]] : run linked pairs on a thread pool, no station name,\n"
+			"        each line of the file has more options for one pair (default threads: one per CPU)\n"
+			"    -j, --hub=<host>[:<port>] : join the link of this name at the channel emulator hub,\n"
+			"        which tells the role and the channel (default port: --port)\n"
+			"    -K, --bond=<channels>[,rr|lq] : send on up to %d channels of --bps each, frames go\n"
+			"        round robin or to the least queued one and are put back in order when received\n"
 			"    -t, --ttl=<seconds> : set time-to-live\n"
 			"\n"
 			"i.e.\n"
 			"    %s -fd3 -b 1e-4 A\n"
 			"    %s --flood --debug=3 --ber=1e-4 A\n"
+			"    %s --sim --flood --ttl=3600\n"
 			"\n",
-			DEFAULT_PORT, argv[0], argv[0]);
+			DEFAULT_TICK, DEFAULT_PORT, DEFAULT_CHAN_BPS, DEFAULT_CHAN_DELAY, BOND_MAX, argv[0], argv[0], argv[0]);
 		exit(0);
 	}
 
@@ -176,33 +703,151 @@ static void config(int argc, char **argv)
 			goto usage;
 
 		case 'u':
-			ber = 0.0;
+			st->ber = 0.0;
+			st->ge_p = 0.0;
 			break;
 
 		case 'f':
-			mode_flood = 1;
+			st->mode_flood = 1;
 			break;
 
 		case 'i':
-			mode_ibib = 1;
+			st->mode_ibib = 1;
 			break;
 
 		case 'n':
 			strcpy(fname, "nul");
 			break;
 
+		case 'k':
+			st->mode_tickless = 1;
+			break;
+
+		case 's':
+			st->mode_sim = 1;
+			st->mode_tickless = 1;
+			break;
+
+		case 'T':
+			st->mode_thread = 1;
+			break;
+
+		case 'U':
+			st->mode_uring = 1;
+			break;
+
+		case 'm':
+			st->mode_shm = 1;
+			break;
+
 		case 'd':
-			debug_mask = atoi(optarg);
+			st->debug_mask = atoi(optarg);
 			break;
 
 		case 'p':
-			port = (unsigned short)atoi(optarg);
+			st->port = (unsigned short)atoi(optarg);
 			break;
 
 		case 'b':
-			ber = strtod(optarg, 0);
-			if (ber >= 1.0) {
-				printf("Bad BER %.3f\n", ber);
+			st->ber = strtod(optarg, 0);
+			if (st->ber >= 1.0) {
+				printf("Bad BER %.3f\n", st->ber);
+				goto usage;
+			}
+			break;
+
+		case 'g':
+			st->ge_k = 0.0;
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &st->ge_p, &st->ge_r, &st->ge_h, &st->ge_k) < 3
+				|| st->ge_p <= 0.0 || st->ge_p >= 1.0 || st->ge_r <= 0.0 || st->ge_r >= 1.0
+				|| st->ge_h < 0.0 || st->ge_h >= 1.0 || st->ge_k < 0.0 || st->ge_k >= 1.0) {
+				printf("Bad Gilbert-Elliott parameters %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'L':
+			st->imp_loss = strtod(optarg, 0);
+			if (st->imp_loss < 0.0 || st->imp_loss >= 1.0) {
+				printf("Bad loss probability %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'D':
+			st->imp_dup = strtod(optarg, 0);
+			if (st->imp_dup < 0.0 || st->imp_dup >= 1.0) {
+				printf("Bad duplication probability %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'R': {
+			char *end;
+			st->imp_reorder = strtod(optarg, &end);
+			st->imp_gap = *end == ',' ? (long long)(strtod(end + 1, 0) * 1000) : 10000;
+			if (st->imp_reorder < 0.0 || st->imp_reorder >= 1.0 || st->imp_gap <= 0) {
+				printf("Bad reordering %s\n", optarg);
+				goto usage;
+			}
+			break;
+		}
+
+		case 'J': {
+			char *end;
+			st->imp_jitter = (long long)(strtod(optarg, &end) * 1000);
+			st->imp_normal = *end == ',' && tolower(end[1]) == 'n';
+			if (st->imp_jitter < 0) {
+				printf("Bad jitter %s\n", optarg);
+				goto usage;
+			}
+			break;
+		}
+
+		case 'r':
+			st->chan_bps = (int)strtod(optarg, 0);
+			if (st->chan_bps < 100 || strtod(optarg, 0) > 2.0E9) {
+				printf("Bad channel bit rate %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'w':
+		case 'W':
+			if (!chan_parse(&st->dir[opt == 'W'], optarg)) {
+				printf("Bad channel direction %s\n", optarg);
+				goto usage;
+			}
+			st->dir_set |= 1 << (opt == 'W');
+			break;
+
+		case 'y':
+			st->chan_delay = (long long)(strtod(optarg, 0) * 1000);
+			if (st->chan_delay < 0) {
+				printf("Bad propagation delay %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'B':
+			st->tb_burst_opt = 2 * atoi(optarg); /* 2 bytes per octet */
+			if (st->tb_burst_opt <= 0) {
+				printf("Bad burst size %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'H':
+			st->sq_high = atoi(optarg);
+			if (st->sq_high <= 0) {
+				printf("Bad high-water mark %s\n", optarg);
+				goto usage;
+			}
+			break;
+
+		case 'C':
+			if ((st->trace = fopen(optarg, "r")) == NULL) {
+				printf("Failed to open trace file \"%s\": %s\n", optarg, strerror(errno));
 				goto usage;
 			}
 			break;
@@ -211,8 +856,32 @@ static void config(int argc, char **argv)
 			strcpy(fname, optarg);
 			break;
 
+		case 'q':
+			st->mode_quiet = 1;
+			break;
+
+		case 'F': /* see link_farm() */
+			break;
+
+		case 'j':
+			strncpy(st->hub, optarg, sizeof(st->hub) - 1);
+			break;
+
+		case 'K': {
+			char *end;
+			st->bond = (int)strtol(optarg, &end, 10);
+			for (i = 0; *end == ',' && bond_policies[i].name && stricmp(end + 1, bond_policies[i].name); i++)
+				;
+			if (st->bond < 1 || st->bond > BOND_MAX || (*end && (*end != ',' || !bond_policies[i].name))) {
+				printf("Bad bonding %s\n", optarg);
+				goto usage;
+			}
+			st->bond_policy = *end ? i : 0;
+			break;
+		}
+
 		case 't':
-			mode_life = atoi(optarg) * 1000; /* ms */
+			st->mode_life = atoi(optarg) * 1000; /* ms */
 			break;
 
 		default:
@@ -221,24 +890,76 @@ static void config(int argc, char **argv)
 		}
 	}
 
-	if (optind == argc) 
-		goto usage;
+	if (st->mode_sim && st->mode_thread)
+		ABORT("--thread cannot be used with --sim");
+	if (st->mode_sim && st->mode_shm)
+		ABORT("--shm cannot be used with --sim");
+	if (st->linked && (st->mode_sim || st->mode_thread || st->mode_shm || st->mode_uring))
+		ABORT("--sim, --thread, --shm and --uring cannot be used with linked stations");
+	if (st->hub[0] && (st->mode_sim || st->mode_shm || st->linked))
+		ABORT("--hub cannot be used with --sim, --shm or linked stations");
+	st->rx_bond = st->bond; /* the same command line, or chan_exchange() tells */
+
+	for (i = 0; i < 2; i++) { /* the other parameters fill what --ab/--ba leave out */
+		struct chan *c = &st->dir[i];
+		if (c->bps < 0)
+			c->bps = st->chan_bps;
+		if (c->delay < 0)
+			c->delay = st->chan_delay;
+		if (c->ber < 0.0)
+			c->ber = st->ber;
+		if (c->ge_p < 0.0) {
+			c->ge_p = st->ge_p;
+			c->ge_r = st->ge_r;
+			c->ge_h = st->ge_h;
+			c->ge_k = st->ge_k;
+		}
+	}
+
+	if (st->mode_sim) /* A first, then B in the thread started by A */
+		st->station = virtual_ns < 0 ? 'a' : 'b';
+	else if (st->linked)
+		; /* set by link_pair() */
+	else if (st->hub[0]) { /* the role comes from the hub */
+		if (optind == argc)
+			goto usage;
+		strncpy(st->name, argv[optind++], HUB_NAME - 1);
+	}
+	else {
+		if (optind == argc) 
+			goto usage;
 
-	station = tolower(argv[optind++][0]);
-	if (station != 'a' && station != 'b')
-		ABORT("Station name must be 'A' or 'B'");
+		st->station = tolower(argv[optind++][0]);
+		if (st->station != 'a' && st->station != 'b')
+			ABORT("Station name must be 'A' or 'B'");
+	}
 
-	if (fname[0] == 0) {
+	if (fname[0] == 0 && st->linked)
+		strcpy(fname, "nul"); /* no log file unless -l names one */
+	else if (fname[0] == 0) {
 		strcpy(fname, argv[0]);
 		if (stricmp(fname + strlen(fname) - 4, ".exe") == 0)
 			*(fname + strlen(fname) - 4) = 0;
-		strcat(fname, station == 'a' ? "-A.log" : "-B.log");
+		if (st->name[0])
+			sprintf(fname + strlen(fname), "-%s.log", st->name);
+		else
+			strcat(fname, st->station == 'a' ? "-A.log" : "-B.log");
+	}
+	else if (st->mode_sim && st->station == 'b' && stricmp(fname, "nul") != 0)
+		log_suffix(fname, "-B"); /* not over the log of A */
+	else if (st->linked && stricmp(fname, "nul") != 0) {
+		char suffix[HUB_NAME + 1];
+
+		sprintf(suffix, "-%s", st->name); /* a log per station of the farm */
+		log_suffix(fname, suffix);
 	}
 
 	if (stricmp(fname, "nul") == 0)
 		log_file = NULL;
 	else if ((log_file = fopen(fname, "w")) == NULL) 
 		printf("WARNING: Failed to create log file \"%s\": %s\n", fname, strerror(errno));
+	st->log = log_file;
+	log_quiet = st->mode_quiet;
 
 	lprintf(
 		"=============================================================\n"
@@ -247,620 +968,3241 @@ static void config(int argc, char **argv)
 		station_name());
 
 	lprintf("Protocol.lib, version %s, jiangyanjun0718@bupt.edu.cn\n", VERSION, __DATE__);
-	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", CHAN_BPS, CHAN_DELAY);
-	if (ber > 0.0)
-		lprintf("%.1E\n", ber);
-	else
-		lprintf("0\n");
-	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
+	if (st->dir_set == 0)
+		chan_log("Channel", &st->dir[st->station == 'a']);
+	else {
+		chan_log("Channel A->B", &st->dir[0]);
+		chan_log("Channel B->A", &st->dir[1]);
+	}
+	if (st->tb_burst_opt)
+		lprintf("Channel burst: %d bytes\n", st->tb_burst_opt / 2);
+	if (st->imp_loss > 0.0 || st->imp_dup > 0.0 || st->imp_reorder > 0.0 || st->imp_jitter > 0)
+		lprintf("Impairments: loss %g, duplicate %g, reorder %g (%g ms), %s jitter %g ms\n",
+			st->imp_loss, st->imp_dup, st->imp_reorder, st->imp_gap / 1000.0,
+			st->imp_normal ? "normal" : "uniform", st->imp_jitter / 1000.0);
+	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, st->port, st->debug_mask);
+	if (st->mode_sim)
+		lprintf("Simulation on a virtual clock\n");
+	else if (st->mode_thread)
+		lprintf("Physical layer on its own thread\n");
+	else if (st->mode_tickless)
+		lprintf("Tickless event loop\n");
 }
 
-/* Create Communication Sockets  */
-
-void protocol_init(int argc, char **argv)
+/* Bytes the channel carries in 'ms' milliseconds (2 per octet), limited to lo..hi */
+static int chan_scale(int lo, int hi, int ms)
 {
-    int admin_sock, i;
-    struct sockaddr_in name;
-
-	socket_init();
-	magic_init();
+    long long n = (long long)st->chan_bps / 4 * ms / 1000;
 
-	config(argc, argv);
-  
-    if (station == 'a') {
-
-        srand(mode_seed ^ 97209);
-
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = INADDR_ANY;
-        name.sin_port = htons(port);
-
-        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (admin_sock < 0) 
-            ABORT("Create TCP socket");
-        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-            lprintf("Station A: Failed to bind TCP port %u", port);
-            ABORT("Station A failed to bind TCP port");
-        }
+    return n < lo ? lo : n > hi ? hi : (int)n;
+}
 
-        listen(admin_sock, 5);
+/*
+   A station shapes what it sends at the rate of its own direction and
+   delays and corrupts what it receives as the other direction says.
+*/
+static void chan_select(void)
+{
+    struct chan *tx = &st->dir[st->station == 'b'], *rx = &st->dir[st->station == 'a'];
+
+    st->chan_bps = tx->bps;
+    st->rx_bps = rx->bps;
+    st->chan_delay = rx->delay;
+    st->ber = rx->ber;
+    st->ge_p = rx->ge_p;
+    st->ge_r = rx->ge_r;
+    st->ge_h = rx->ge_h;
+    st->ge_k = rx->ge_k;
+}
 
-        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
-        fflush(stdout);
+/* Delay (us) from arrival to commit of received data, less 'base' for the jitter */
+static long long chan_blk_delay(long long delay, long long *base)
+{
+    long long d;
 
-        sock = accept(admin_sock, 0, 0);
-        if (sock < 0) 
-            ABORT("Station A failed to communicate with station B");
-        lprintf("Done.\n");
+    delay = delay > st->hub_hold ? delay - st->hub_hold : 0;
+    d = delay - (delay / 2 < 10000 ? delay / 2 : 10000);
 
-        recv(sock, (char *)&epoch, sizeof(epoch), 0);
-    }
+    /* the jitter varies the delay around its mean as far as the delay allows */
+    *base = st->imp_jitter < d ? st->imp_jitter : d;
+    return d - *base;
+}
 
-    if (station == 'b') {
+/* Sizes that follow the sending rate, again whenever the trace changes it */
+static void chan_rate(void)
+{
+    st->sq_level = chan_scale(PHL_SQ_LEVEL, SQ_MAX / 8, DEFAULT_TICK);
+    if (st->sq_high < st->sq_level)
+        st->sq_high = st->sq_level;
+    st->send_chunk = chan_scale(1, SQ_SEG_MAX, DEFAULT_TICK);
+    st->tb_burst = st->tb_burst_opt ? st->tb_burst_opt : chan_scale(1, SQ_SEG_MAX, 1);
+}
 
-        srand(mode_seed ^ 18231);
+/* Sizes derived from the channel parameters */
+static void chan_init(void)
+{
+    long long n;
+    int i;
 
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock < 0) 
-            ABORT("Create TCP socket");
+    chan_select();
+    n = 16LL * st->rx_bps * st->rx_bond / 8 / (1000 / DEFAULT_TICK);
+    st->blksize = n < BLK_MIN ? BLK_MIN : n > BLK_MAX ? BLK_MAX : (int)n;
+    st->imp_on = st->imp_loss > 0.0 || st->imp_dup > 0.0 || st->imp_reorder > 0.0 || st->imp_jitter > 0;
+    st->blk_delay = chan_blk_delay(st->chan_delay, &st->imp_base);
+    if (st->hub_hold > st->chan_delay)
+        ABORT("The hub holds frames longer than the propagation delay, see lag= of the medium");
+    st->sq_seg = chan_scale(SQ_SEG_MIN, SQ_SEG_MAX, DEFAULT_TICK);
+    chan_rate();
+    for (i = 0; i < st->bond; i++)
+        st->sq[i].tb_idle = 1;
+    if (st->hub_hold && (st->bond > 1 || st->rx_bond > 1))
+        ABORT("--bond cannot be used on a shared medium");
+    if (st->bond > 1 || st->rx_bond > 1)
+        lprintf("Bonded channels: sending on %d (%s), receiving on %d\n", st->bond, bond_policies[st->bond_policy].name, st->rx_bond);
+}
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = inet_addr("127.0.0.1");
-        name.sin_port = htons((short)port);
-
-        for (i = 0; i < 60; i++) {
-            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
-            fflush(stdout);
-
-            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
-                lprintf("Failed!\n");
-                Sleep(2000);
-            } else {
-                lprintf("Done.\n");
-                break;
-            }
-        }
-        if (i == 6)
-            ABORT("Station B failed to connect station A");
+static int tcp_send(const unsigned char *buf, int len)
+{
+    return send(st->sock, (const char *)buf, len, 0);
+}
 
-        time(&epoch);
-        send(sock, (char *)&epoch, sizeof(epoch), 0);
-    }
+/* Both pieces of a wrapped sending queue in one call */
+static int tcp_sendv(const unsigned char *buf1, int len1, const unsigned char *buf2, int len2)
+{
+#ifdef _WIN32
+    int n = send(st->sock, (const char *)buf1, len1, 0); /* no writev() in Winsock 1.1 */
 
-    {
-        struct tm *newtime;
-        newtime = localtime(&epoch);
-        lprintf("New epoch: %s", asctime(newtime));
-        lprintf("=================================================================\n\n");
+    if (n == len1 && len2 > 0) {
+        int m = send(st->sock, (const char *)buf2, len2, 0);
+        if (m > 0)
+            n += m;
     }
+    return n;
+#else
+    struct iovec iov[2];
+
+    iov[0].iov_base = (void *)buf1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = (void *)buf2;
+    iov[1].iov_len = len2;
+    return (int)writev(st->sock, iov, 2);
+#endif
+}
 
-    /* socket options */
-    {
-        int timeout_ms = 10; 
-        int buf_size = 1024 * 64;
-        int on = 1;
+static int tcp_recv(unsigned char *buf, int size, long long *ts)
+{
+    *ts = st->phl_us;
+    return recv(st->sock, (char *)buf, size, 0);
+}
 
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
+static int tcp_poll(void)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
 
-        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
+    tm.tv_sec = tm.tv_usec = 0;
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    FD_SET(st->sock, &rfd);
+    FD_SET(st->sock, &wfd);
 
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
-    }   
+    if (select(st->sock + 1, &rfd, &wfd, 0, &tm) < 0) 
+        ABORT("system select()");
 
-    get_ms();
+    return (FD_ISSET(st->sock, &rfd) ? PHL_READABLE : 0) | (FD_ISSET(st->sock, &wfd) ? PHL_WRITABLE : 0);
 }
 
-/* Physical Layer: Sender */
-
-/* Sending queue structure */
+/* Block until the socket is readable or 'us' microseconds elapse */
+static void tcp_wait(long long us)
+{
+#ifdef _WIN32
+    fd_set rfd;
+    struct timeval tm;
 
-#define SQ_SIZE (128 * 1024) 
+    FD_ZERO(&rfd);
+    FD_SET(st->sock, &rfd);
+    tm.tv_sec = (long)(us / 1000000);
+    tm.tv_usec = (long)(us % 1000000);
+    if (select(st->sock + 1, &rfd, 0, 0, &tm) < 0)
+        ABORT("system select()");
+#else
+    struct pollfd pfd;
+    struct timespec ts;
+
+    pfd.fd = st->sock;
+    pfd.events = POLLIN;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    if (ppoll(&pfd, 1, &ts, NULL) < 0 && errno != EINTR)
+        ABORT("system ppoll()");
+#endif
+}
 
-static unsigned char sq[SQ_SIZE];
-static int sq_head, sq_tail;
-static int inform_phl_ready = 1;
+static const struct transport tcp_transport = { tcp_send, tcp_sendv, tcp_recv, tcp_poll, tcp_wait };
 
-#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+/* TCP connection between the stations */
 
-static int send_bytes_allowed = 0;
+/* Read exactly 'len' bytes while setting up, 0 if the connection is lost */
+static int tcp_read(void *buf, int len)
+{
+    int i, n;
 
-static int sq_len(void)
-{
-    return (sq_tail + SQ_SIZE - sq_head) % SQ_SIZE;
+    for (i = 0; i < len; i += n) {
+        n = recv(st->sock, (char *)buf + i, len - i, 0);
+        if (n == 0)
+            return 0;
+        if (n < 0) { /* SO_RCVTIMEO may be set already */
+#ifdef _WIN32
+            if (WSAGetLastError() != WSAETIMEDOUT)
+#else
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+#endif
+                return 0;
+            n = 0;
+        }
+    }
+    return 1;
 }
 
-int phl_sq_len(void)
+/*
+   Agree on the directions given with --ab/--ba: the peer's settings fill
+   in what this station leaves out, and A's win where both give one.
+   Whether the peer asks for shared memory and the channels it bonds come
+   along.
+*/
+static void chan_exchange(void)
 {
-    return sq_len();
+    struct chan_offer me, peer;
+    int i;
+
+    me.set = st->dir_set;
+    me.shm = st->mode_shm;
+    me.bond = st->bond;
+    memcpy(me.dir, st->dir, sizeof(me.dir));
+    if (send(st->sock, (char *)&me, sizeof(me), 0) != sizeof(me))
+        ABORT("Failed to send channel parameters");
+    if (!tcp_read(&peer, sizeof(peer)))
+        ABORT("Failed to receive channel parameters");
+    st->peer_shm = peer.shm;
+    st->rx_bond = peer.bond > 1 && peer.bond <= BOND_MAX ? peer.bond : 1;
+
+    for (i = 0; i < 2; i++) {
+        if ((peer.set & 1 << i) && (!(me.set & 1 << i) || st->station == 'b')) {
+            st->dir[i] = peer.dir[i];
+            st->dir_set |= 1 << i;
+        }
+    }
+    if (peer.set & ~me.set) {
+        lprintf("Channel parameters agreed with the peer station:\n");
+        chan_log("Channel A->B", &st->dir[0]);
+        chan_log("Channel B->A", &st->dir[1]);
+    }
+    chan_select();
 }
 
-static void send_byte(unsigned char byte)
+/* Connect to 'host' retrying for two minutes, the socket or -1 */
+static int tcp_connect(const char *host, unsigned short port, const char *what)
 {
-    inform_phl_ready = 1;
-
-    if (send_bytes_allowed && sq_head == sq_tail) {
-        send(sock, (char *)&byte, 1, 0);
-        send_bytes_allowed--;
-        return;
+    struct sockaddr_in name;
+    struct hostent *he;
+    int sock, i;
+
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+        ABORT("Create TCP socket");
+
+    name.sin_family = AF_INET;
+    name.sin_port = htons(port);
+    if ((name.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE) {
+        if ((he = gethostbyname(host)) == NULL)
+            return -1;
+        memcpy(&name.sin_addr, he->h_addr, sizeof(name.sin_addr));
     }
 
-    if (sq_len() == SQ_SIZE - 1)
-        ABORT("Physical Layer Sending Queue overflow");
+    for (i = 0; i < 60; i++) {
+        lprintf("Station %s is connecting %s (TCP port %u) ... ", station_name(), what, port);
+        fflush(stdout);
 
-    sq[sq_tail] = byte;
-    sq_inc(sq_tail, 1);
+        if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
+            lprintf("Failed!\n");
+            Sleep(2000);
+        } else {
+            lprintf("Done.\n");
+            return sock;
+        }
+    }
+    return -1;
 }
 
-void send_frame(unsigned char *frame, int len)
+/* Join the link of this station's name at the hub, which tells its role and channel */
+static void hub_join(void)
 {
+    struct HUB_HELLO hello;
+    struct HUB_REPLY reply;
+    char host[sizeof(st->hub)], *p;
+    unsigned short port = st->port;
     int i;
 
-    send_byte(0xff);
-    
-    for (i = 0; i < len; i++) {
-        send_byte(frame[i] & 0x0f);
-        send_byte((frame[i] & 0xf0) >> 4);
+    strcpy(host, st->hub);
+    if ((p = strchr(host, ':')) != NULL) {
+        *p = 0;
+        port = (unsigned short)atoi(p + 1);
+    }
+    if ((st->sock = tcp_connect(host, port, "the hub")) < 0)
+        ABORT("Failed to connect the hub");
+
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = HUB_MAGIC;
+    strcpy(hello.name, st->name);
+    if (send(st->sock, (char *)&hello, sizeof(hello), 0) != sizeof(hello))
+        ABORT("Failed to join the hub");
+
+    lprintf("Station %s is waiting for its peer at the hub ... ", st->name);
+    fflush(stdout);
+    if (!tcp_read(&reply, sizeof(reply)))
+        ABORT("The hub closed the connection");
+    if (reply.role != 'a' && reply.role != 'b')
+        ABORT("The hub has no link for this station");
+    reply.peer[HUB_NAME - 1] = 0;
+    lprintf("Done, linked to %s as station %c.\n", reply.peer, toupper(reply.role));
+
+    /* the hub's channel overrides the command line */
+    st->station = reply.role;
+    st->hub_hold = reply.hold;
+    if (reply.hold)
+        lprintf("The link shares a medium, the hub holds each frame %g ms of the propagation delay\n", reply.hold / 1000.0);
+    for (i = 0; i < 2; i++) {
+        reply.dir[i][HUB_SPEC - 1] = 0;
+        if (reply.dir[i][0] == 0)
+            continue;
+        if (!chan_parse(&st->dir[i], reply.dir[i]))
+            ABORT("Bad channel parameters from the hub");
+        st->dir_set |= 1 << i;
     }
-    send_byte(0xff);
+    if (st->dir_set) {
+        chan_log("Channel A->B", &st->dir[0]);
+        chan_log("Channel B->A", &st->dir[1]);
+    }
+    srand(st->mode_seed ^ (st->station == 'a' ? 97209 : 18231));
 }
 
-static int send_sq_data(unsigned int start, unsigned int end1)
+static void tcp_init(void)
 {
-    int ret;
-
-    if (start >= end1) 
-        return 0;
+    int admin_sock;
+    struct sockaddr_in name;
 
-    ret = send(sock, (char *)&sq[start], end1 - start, 0);
-    if (ret <= 0) {
-        lprintf("TCP Disconnected.\n");
-        exit(0);
+    if (st->hub[0]) {
+        hub_join();
+        if (st->station == 'a') {
+            recv(st->sock, (char *)&epoch, sizeof(epoch), 0);
+        } else {
+            time(&epoch);
+            send(st->sock, (char *)&epoch, sizeof(epoch), 0);
+        }
     }
+    else if (st->station == 'a') {
 
-    return ret;
-}
-
-static void socket_send(void)
-{
-    static int last_ts = 0;
-    int n, send_tail = sq_head, send_bytes;
+        srand(st->mode_seed ^ 97209);
 
-    if (last_ts == 0) 
-        last_ts = now;
+        name.sin_family = AF_INET;
+        name.sin_addr.s_addr = INADDR_ANY;
+        name.sin_port = htons(st->port);
 
-    if (now <= last_ts) 
-        return;
+        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (admin_sock < 0) 
+            ABORT("Create TCP socket");
+        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+            lprintf("Station A: Failed to bind TCP port %u", st->port);
+            ABORT("Station A failed to bind TCP port");
+        }
 
-    send_bytes_allowed = (now - last_ts) * CHAN_BPS / 8 / 1000 * 2;
-    n = sq_len();
-    if (n > send_bytes_allowed)
-        n = send_bytes_allowed;
-    sq_inc(send_tail, n);
+        listen(admin_sock, 5);
 
-    if (send_tail >= sq_head) 
-        send_bytes = send_sq_data(sq_head, send_tail);
-    else {
-        send_bytes = send_sq_data(sq_head, SQ_SIZE);
-        send_bytes += send_sq_data(0, send_tail);
-    }
+        lprintf("Station A is waiting for station B on TCP port %u ... ", st->port);
+        fflush(stdout);
 
-    sq_inc(sq_head, send_bytes);
-    send_bytes_allowed -= send_bytes;
+        st->sock = accept(admin_sock, 0, 0);
+        if (st->sock < 0) 
+            ABORT("Station A failed to communicate with station B");
+        lprintf("Done.\n");
 
-    last_ts = now;
-}
+        recv(st->sock, (char *)&epoch, sizeof(epoch), 0);
+    }
 
-/* Physical Layer: Receiver */
+    else if (st->station == 'b') {
 
-#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK))
+        srand(st->mode_seed ^ 18231);
 
-struct BLK {
-    int commit_ts;
-    int rptr, wptr;
-    struct BLK *link;
-    unsigned char data[BLKSIZE];
-};
+        if ((st->sock = tcp_connect("127.0.0.1", st->port, "station A")) < 0)
+            ABORT("Station B failed to connect station A");
 
-static struct BLK *rblk_head, *rblk_tail;
-static unsigned int nbits;
+        time(&epoch);
+        send(st->sock, (char *)&epoch, sizeof(epoch), 0);
+    }
 
-static void socket_recv(void)
-{
-    struct BLK *blk;
-    unsigned char *p;
+    clock_init(); /* before anything more is logged */
+    chan_exchange();
 
-    blk = (struct BLK *)malloc(sizeof(struct BLK));
-    if (blk == NULL) 
-        ABORT("No enough memory");
+    /* socket options */
+    {
+        int timeout_ms = 10; 
+        int buf_size = chan_scale(SOCKBUF_MIN, SOCKBUF_MAX, 100);
+        int on = 1;
 
-    blk->rptr = 0;
-    blk->wptr = recv(sock, (char *)blk->data, BLKSIZE, 0);
-    if (blk->wptr <= 0) {
-        lprintf("TCP disconnected.\n");
-        exit(0);
-    }
-    nbits += blk->wptr * 4;
+        setsockopt(st->sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
+        setsockopt(st->sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
 
-    /* Impose noise */
-    if (ber != 0.0) {
-        int a;
-        double rate, fact;
-
-        rate = (double)noise / nbits;
-        fact = rate > ber ? 3.5 : 6.0;
-        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr)) * (RAND_MAX + 1.0) + 0.5);
-        if (rand() <= a) {
-            p = &blk->data[rand() % blk->wptr];
-            if (*p & 0x0f) {
-                *p ^= 1 << (rand() % 8);
-                noise++;
-                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
-            }
-        }
-    }
+        setsockopt(st->sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(st->sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
 
-    blk->commit_ts = now + CHAN_DELAY - 10;
-    blk->link = NULL; 
+        setsockopt(st->sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
+    }   
 
-    if (rblk_head == NULL) 
-        rblk_head = rblk_tail = blk;
-    else {
-        rblk_tail->link = blk;
-        rblk_tail = blk;
-    }
+    st->tp = &tcp_transport;
 }
 
-static unsigned char recv_byte(void)
+/* io_uring transport (Linux) */
+
+/*
+   A standing multishot receive fills buffers provided to the kernel through
+   a registered buffer ring; recv() hands them out and gives them back once
+   they are used up. Sends are copied into one of two staging buffers and
+   submitted together with the next poll or wait, so a loop iteration
+   costs at most one io_uring_enter() instead of a select(), a recv() per
+   block and a send() per segment.
+*/
+
+#ifdef HAVE_URING
+
+#define URING_ENTRIES 64
+#define URING_NBUF    64          /* provided receive buffers, power of 2 */
+#define URING_BUFSIZE 4096
+#define URING_SBUFSIZE (64 * 1024)
+#define URING_RECV    0x100       /* user_data of the receive, sends use 0 and 1 */
+
+struct URING {
+    int fd;
+    unsigned *sq_head, *sq_tail, sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+
+    /* receiver */
+    struct io_uring_buf_ring *br;
+    unsigned char *rbuf;
+    unsigned short br_tail;
+    int rq_bid[URING_NBUF], rq_len[URING_NBUF]; /* filled buffers in order */
+    int rq_head, rq_n, rq_off;
+    int armed, closed;
+
+    /* sender */
+    unsigned char sbuf[2][URING_SBUFSIZE];
+    int slen[2], soff[2], sbusy[2];
+    int cur;
+};
+
+static int uring_enter(unsigned wait_nr, long long us)
 {
-    unsigned char ch;
-    struct BLK *blk = rblk_head;
+    struct URING *u = st->uring;
+    struct io_uring_getevents_arg arg;
+    struct timespec ts;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
 
-    if (blk == NULL || blk->commit_ts > now) 
-        ABORT("recv_byte(): Receiving Queue is empty");
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr && us >= 0) {
+        ts.tv_sec = us / 1000000;
+        ts.tv_nsec = us % 1000000 * 1000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
 
-    ch = blk->data[blk->rptr++];
-    if (blk->rptr == blk->wptr) {
-        rblk_head = blk->link;
-        free(blk);
-    } 
-    
-    return ch;
+    ret = (int)syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait_nr, flags, 
+        flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL, sizeof(arg));
+    if (ret >= 0)
+        u->to_submit -= (unsigned)ret < u->to_submit ? (unsigned)ret : u->to_submit;
+    else if (errno != EINTR && errno != ETIME && errno != EBUSY)
+        ABORT("system io_uring_enter()");
+
+    return ret;
 }
 
-/* Timer Management */
+static struct io_uring_sqe *uring_sqe(void)
+{
+    struct URING *u = st->uring;
+    struct io_uring_sqe *sqe;
+    unsigned tail = *u->sq_tail;
 
-#define NTIMER 129
-static int timer[NTIMER];
-#define ACK_TIMER_ID (NTIMER - 1)
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_mask)
+        uring_enter(0, 0);
 
-void start_timer(unsigned int nr, unsigned int ms)
-{
-    if (nr >= ACK_TIMER_ID) 
-        ABORT("start_timer(): timer No. must be 0~128");
-    timer[nr] = now + phl_sq_len() * 8000 / CHAN_BPS + ms;
-}
+    sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
 
-void stop_timer(unsigned int nr)
-{
-    if (nr < ACK_TIMER_ID) 
-        timer[nr] = 0;
+    return sqe;
 }
 
-int get_timer(unsigned int nr)
+static void uring_arm(void)
 {
-    if (nr >= ACK_TIMER_ID || timer[nr] == 0)
-        return 0;
-    return timer[nr] > now ? timer[nr] - now : 0;
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = st->sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_RECV;
+    st->uring->armed = 1;
 }
 
-void start_ack_timer(unsigned int ms)
+static void uring_give_buf(int bid)
 {
-    if (timer[ACK_TIMER_ID] == 0)
-        timer[ACK_TIMER_ID] = now + ms;
+    struct URING *u = st->uring;
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (URING_NBUF - 1)];
+
+    b->addr = (unsigned long long)(uintptr_t)(u->rbuf + bid * URING_BUFSIZE);
+    b->len = URING_BUFSIZE;
+    b->bid = (unsigned short)bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
 }
 
-void stop_ack_timer(void)
+static void uring_send_sbuf(int i)
 {
-    timer[ACK_TIMER_ID] = 0;
+    struct URING *u = st->uring;
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = st->sock;
+    sqe->addr = (unsigned long long)(uintptr_t)(u->sbuf[i] + u->soff[i]);
+    sqe->len = u->slen[i] - u->soff[i];
+    sqe->user_data = i;
+    u->sbusy[i] = 1;
 }
 
-static int scan_timer(int *nr)
+static void uring_reap(void)
 {
+    struct URING *u = st->uring;
+    struct io_uring_cqe *cqe;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
     int i;
 
-    for (i = 0; i < NTIMER; i++) {
-        if (timer[i] && timer[i] <= now) {
-            *nr = i;
-            timer[i] = 0;
-            return i == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
+    for (; head != tail; head++) {
+        cqe = &u->cqes[head & u->cq_mask];
+        if (cqe->user_data == URING_RECV) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                u->armed = 0;
+            if (cqe->res > 0) {
+                i = (u->rq_head + u->rq_n++) % URING_NBUF;
+                u->rq_bid[i] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                u->rq_len[i] = cqe->res;
+            } else if (cqe->res != -ENOBUFS)
+                u->closed = 1;
+        } else {
+            i = (int)cqe->user_data;
+            if (cqe->res <= 0)
+                u->closed = 1;
+            else if (u->soff[i] + cqe->res < u->slen[i]) {
+                u->soff[i] += cqe->res;
+                uring_send_sbuf(i);
+                continue;
+            }
+            u->slen[i] = u->soff[i] = u->sbusy[i] = 0;
         }
     }
-    return 0;
-}
-
-/* Network Layer Functions */
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
 
-static int network_layer_active = 0;
-static int rpackets, rbytes;
-
-void enable_network_layer(void)
-{
-    network_layer_active = 1;
+    /* out of buffers stops the multishot receive, restart it once one is back */
+    if (!u->armed && !u->closed && u->rq_n < URING_NBUF)
+        uring_arm();
 }
 
-void disable_network_layer(void)
+/* Submit the staged sends */
+static void uring_flush(void)
 {
-    network_layer_active = 0;
+    struct URING *u = st->uring;
+
+    if (u->slen[u->cur] > 0 && !u->sbusy[u->cur]) {
+        uring_send_sbuf(u->cur);
+        u->cur ^= 1;
+    }
+    if (u->to_submit)
+        uring_enter(0, 0);
 }
 
-static int network_layer_ready(void)
+static int uring_send(const unsigned char *buf, int len)
 {
-    static int last_ts = 0;
-
-    if (!network_layer_active)
-        return 0;
+    struct URING *u = st->uring;
+    int n, left = len;
 
-    if (mode_flood) 
-        return 1;
+    while (left > 0) {
+        while (u->sbusy[u->cur] && !u->closed) {
+            uring_enter(1, -1);
+            uring_reap();
+        }
+        if (u->closed)
+            return -1;
+
+        n = URING_SBUFSIZE - u->slen[u->cur];
+        if (n > left)
+            n = left;
+        memcpy(u->sbuf[u->cur] + u->slen[u->cur], buf, n);
+        u->slen[u->cur] += n;
+        buf += n;
+        left -= n;
+        if (u->slen[u->cur] == URING_SBUFSIZE)
+            uring_flush();
+    }
 
-    if ((now - last_ts) * CHAN_BPS / 8 / 1000 < PKT_LEN * 3 / 4)
-        return 0;
+    return len;
+}
 
-    if (station == 'b') {
-        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
-            if (now - last_ts < 4000 + rand() % 500)
-                return 0;
+/* Like recv(), takes as much as fits from the buffers filled so far */
+static int uring_recv(unsigned char *buf, int size, long long *ts)
+{
+    struct URING *u = st->uring;
+    int n, bid, len = 0;
+
+    *ts = st->phl_us;
+
+    while (len < size && u->rq_n > 0) {
+        bid = u->rq_bid[u->rq_head];
+        n = u->rq_len[u->rq_head] - u->rq_off;
+        if (n > size - len)
+            n = size - len;
+        memcpy(buf + len, u->rbuf + bid * URING_BUFSIZE + u->rq_off, n);
+        len += n;
+        u->rq_off += n;
+        if (u->rq_off == u->rq_len[u->rq_head]) {
+            uring_give_buf(bid);
+            u->rq_head = (u->rq_head + 1) % URING_NBUF;
+            u->rq_n--;
+            u->rq_off = 0;
         }
-        if (now < CHAN_DELAY + 3 * PKT_LEN * 8000 / CHAN_BPS)
-            return 0;
     }
 
-    last_ts = now;
-
-    return 1;
+    return len;
 }
 
-static int randA(void)
+static int uring_poll(void)
 {
-    static unsigned int holdrand = 0x65109bc4;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    uring_reap();
+    uring_flush();
+
+    return (st->uring->rq_n || st->uring->closed ? PHL_READABLE : 0) | PHL_WRITABLE;
 }
 
-static int randB(void)
+static void uring_wait(long long us)
 {
-    static unsigned int holdrand = 0x1e459090;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    uring_reap();
+    uring_flush();
+    if (st->uring->rq_n || st->uring->closed)
+        return;
+    uring_enter(1, us);
+    uring_reap();
 }
 
-#define next_char() ((unsigned char)(my_rand() & 0xff))
-
-static int layer3_ready = 0;
+static const struct transport uring_transport = { uring_send, NULL, uring_recv, uring_poll, uring_wait };
 
-int get_packet(unsigned char *packet)
+static void *uring_mmap(size_t len, off_t off)
 {
-    static int pkt_no = 0;
-    int i, len;
-    int (*my_rand)(void) = station == 'a' ? randA : randB;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, st->uring->fd, off);
 
-    if (!layer3_ready)
-        ABORT("get_packet(): Network layer is not ready for a new packet");
-    
-    len = PKT_LEN;
-    for (i = 2; i < len; i++)
-        packet[i] = next_char();
-    *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
+    return p == MAP_FAILED ? NULL : p;
+}
 
-    layer3_ready = 0;
+/* Switch the connected socket over to io_uring, 0 if the kernel cannot */
+static int uring_init(void)
+{
+    struct URING *u;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned char *sq, *cq;
+    int i;
 
-    return len;
+    u = (struct URING *)calloc(1, sizeof(struct URING));
+    if (u == NULL)
+        ABORT("No enough memory");
+    st->uring = u;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0)
+        goto fail;
+
+    sq = (unsigned char *)uring_mmap(p.sq_off.array + p.sq_entries * sizeof(unsigned), IORING_OFF_SQ_RING);
+    cq = (unsigned char *)uring_mmap(p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe *)uring_mmap(p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+    if (sq == NULL || cq == NULL || u->sqes == NULL)
+        goto fail;
+
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* provided receive buffers */
+    u->br = (struct io_uring_buf_ring *)mmap(NULL, URING_NBUF * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->rbuf = (unsigned char *)malloc(URING_NBUF * URING_BUFSIZE);
+    if (u->br == MAP_FAILED || u->rbuf == NULL)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)u->br;
+    reg.ring_entries = URING_NBUF;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < URING_NBUF; i++)
+        uring_give_buf(i);
+
+    uring_arm();
+    uring_enter(0, 0);
+
+    st->tp = &uring_transport;
+    return 1;
+
+fail:
+    lprintf("WARNING: io_uring is not available (%s), using socket calls\n", strerror(errno));
+    if (u->fd >= 0)
+        close(u->fd);
+    st->uring = NULL;
+    free(u);
+    return 0;
 }
 
-static int ts0;
+#else
 
-void put_packet(unsigned char *packet, int len)
+static int uring_init(void)
 {
-    static int last_ts = 0;
-    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+    lprintf("WARNING: io_uring is not supported here, using socket calls\n");
+    return 0;
+}
 
-    if (len != PKT_LEN) 
-        ABORT("Bad Packet length");
+#endif
 
-    for (i = 2; i < PKT_LEN; i++) {
-        if (packet[i] != next_char()) 
-            ABORT("Network Layer received a bad packet from data link layer");
-    }
-    rpackets++;
-    rbytes += len;
+/* Shared memory transport */
+
+/*
+   Each station writes into its own ring of a shared mapping and reads the
+   peer's; head and tail only ever move forward, each written by one side,
+   so no lock is needed. A side that runs out of data or room flags itself
+   waiting, then sleeps on the index the other side moves: a futex on Linux,
+   an event on Windows. The other side only makes a system call when it
+   sees the flag, so a busy link exchanges data without any. The TCP
+   connection only serves to set it up.
+*/
+
+#ifdef HAVE_SHM
+
+#define SHM_SIZE (256 * 1024) /* bytes per ring between processes, power of 2 */
+#define SHM_MIN  4096         /* least bytes per ring in a process */
+#define SHM_POLL 10000        /* us between checks that the peer is alive */
+#define SHM_ALIGN(n) (((n) + 63) & ~(size_t)63)
+
+struct SHM_RING {
+    unsigned head;              /* bytes read, by the reader */
+    int rwait;                  /* reader waits for data */
+    char pad1[56];
+    unsigned tail;              /* bytes written, by the writer */
+    int wwait;                  /* writer waits for room */
+    int closed;                 /* writer quit */
+    unsigned size;              /* power of 2 */
+    char pad2[48];
+    unsigned char data[1];
+};
 
-    if (now - last_ts > 2000 && now > ts0 + 2000) {
-        double bps;
-        bps = (double)rbytes * 8 * 1000 / (now - ts0);
-        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
-            rpackets, bps, bps / CHAN_BPS * 100, noise, (double)noise/nbits);
-        last_ts = now;
+struct SHM {
+    int pid[2];
+    unsigned off[2];            /* of ring 0 (A to B) and ring 1 (B to A) */
+};
+
+#define shm_ring(a, i) ((struct SHM_RING *)((char *)(a) + (a)->off[i]))
+
+struct SHMS {
+    struct SHM *area;
+    struct SHM_RING *tx, *rx;
+    int me;                     /* tx is ring 'me', rx ring 1 - me */
+    int local;                  /* both stations in this process, see link_pair() */
+    long long check_us;         /* last check that the peer is alive */
+#ifdef _WIN32
+    HANDLE map, peer;
+    HANDLE ev[2][2];            /* [ring][0]: data, [ring][1]: room */
+#endif
+};
+
+static struct SHMS *shm_self; /* for the exit handler, st is per thread */
+
+/* Bytes of an area with rings of 'size0' and 'size1', laid out in 'a' if given */
+static size_t shm_layout(struct SHM *a, unsigned size0, unsigned size1)
+{
+    size_t off0 = SHM_ALIGN(sizeof(struct SHM));
+    size_t off1 = off0 + SHM_ALIGN(offsetof(struct SHM_RING, data) + size0);
+
+    if (a) {
+        a->off[0] = (unsigned)off0;
+        a->off[1] = (unsigned)off1;
+        shm_ring(a, 0)->size = size0;
+        shm_ring(a, 1)->size = size1;
     }
+    return off1 + offsetof(struct SHM_RING, data) + size1;
 }
 
-#define DBG_EVENT    0x01
-#define DBG_FRAME    0x02
-#define DBG_WARNING  0x04
+static void shm_attach(struct SHMS *s, struct SHM *area, int me)
+{
+    s->area = area;
+    s->me = me;
+    s->tx = shm_ring(area, me);
+    s->rx = shm_ring(area, 1 - me);
+}
 
-void dbg_event(char *fmt, ...)
+#ifdef _WIN32
+/* The event that stands for the tail (data) or the head (room) of a ring */
+static HANDLE shm_event(struct SHMS *s, unsigned *word)
 {
-	va_list arg_ptr;
+    struct SHM_RING *r = word == &s->tx->head || word == &s->tx->tail ? s->tx : s->rx;
 
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    return s->ev[r == s->tx ? s->me : 1 - s->me][word == &r->head];
 }
+#else
+/* Both stations in this process need no futex shared between processes */
+#define shm_futex(s, op) ((s)->local ? (op) | FUTEX_PRIVATE_FLAG : (op))
+#endif
 
-void dbg_frame(char *fmt, ...)
+/* Sleep while *word == val, at most 'us' */
+static void shm_sleep(struct SHMS *s, unsigned *word, unsigned val, long long us)
 {
-	va_list arg_ptr;
+#ifdef _WIN32
+    HANDLE h[2];
+
+    h[0] = shm_event(s, word);
+    h[1] = s->peer;
+    if ((unsigned)ATOMIC_LOAD(word) == val)
+        WaitForMultipleObjects(s->peer ? 2 : 1, h, FALSE, (DWORD)((us + 999) / 1000));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = us % 1000000 * 1000;
+    syscall(SYS_futex, word, shm_futex(s, FUTEX_WAIT), val, &ts, NULL, 0);
+#endif
+}
 
-	if (debug_mask & DBG_FRAME) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+static void shm_wake(struct SHMS *s, unsigned *word)
+{
+#ifdef _WIN32
+    SetEvent(shm_event(s, word));
+#else
+    syscall(SYS_futex, word, shm_futex(s, FUTEX_WAKE), 1, NULL, NULL, 0);
+#endif
 }
 
-void dbg_warning(char *fmt, ...)
+/* The peer quit, or died without saying so; looks every SHM_POLL us */
+static int shm_gone(struct SHMS *s)
 {
-	va_list arg_ptr;
+    long long now;
 
-	if (debug_mask & DBG_WARNING) {
-		va_start(arg_ptr, fmt);
-		__v_lprintf(fmt, arg_ptr);
-		va_end(arg_ptr);
-	}
+    if (ATOMIC_LOAD(&s->rx->closed))
+        return 1;
+    if (s->local)
+        return 0;
+    now = get_us();
+    if (now - s->check_us < SHM_POLL)
+        return 0;
+    s->check_us = now;
+#ifdef _WIN32
+    if (WaitForSingleObject(s->peer, 0) != WAIT_OBJECT_0)
+#else
+    if (kill(s->area->pid[1 - s->me], 0) == 0 || errno != ESRCH)
+#endif
+        return 0;
+    ATOMIC_STORE(&s->rx->closed, 1);
+    return 1;
 }
 
-/* Event Generator */
-
-#define PHL_SQ_LEVEL  50 
+static int shm_send(const unsigned char *buf, int len)
+{
+    struct SHMS *s = st->shm;
+    struct SHM_RING *r = s->tx;
+    unsigned tail = r->tail, head;
+    int n, off;
 
-static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
-static int bias_cnt;
+    for (;;) {
+        head = ATOMIC_LOAD(&r->head);
+        if (tail - head < r->size)
+            break;
+        if (s->local) /* the reader may be waiting for this thread */
+            return 0;
+        ATOMIC_STORE(&r->wwait, 1);
+        ATOMIC_FENCE();
+        if ((unsigned)ATOMIC_LOAD(&r->head) == head) {
+            if (shm_gone(s))
+                return -1;
+            shm_sleep(s, &r->head, head, SHM_POLL);
+        }
+        ATOMIC_STORE(&r->wwait, 0);
+    }
 
-struct RCV_FRAME {
-    int len;
-    int state;
-    unsigned char frame[2048];
-    struct RCV_FRAME *link;
-};
+    n = (int)(r->size - (tail - head));
+    if (n > len)
+        n = len;
+    off = tail & (r->size - 1);
+    if (off + n <= (int)r->size)
+        memcpy(r->data + off, buf, n);
+    else {
+        memcpy(r->data + off, buf, r->size - off);
+        memcpy(r->data, buf + r->size - off, n - (r->size - off));
+    }
+    ATOMIC_STORE(&r->tail, tail + n);
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD(&r->rwait))
+        shm_wake(s, &r->tail);
 
-static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+    return n;
+}
 
-int recv_frame(unsigned char *buf, int size)
+static int shm_recv(unsigned char *buf, int size, long long *ts)
 {
-    int len;
-    struct RCV_FRAME *next;
-    char msg[256];
-
-    if (rf_head == NULL) 
-        ABORT("recv_frame(): Receiving Queue is empty");
-
-    len = rf_head->len;
-
-    if (size < len) { 
-        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
-        ABORT(msg);
+    struct SHMS *s = st->shm;
+    struct SHM_RING *r = s->rx;
+    unsigned head = r->head;
+    int n = (int)((unsigned)ATOMIC_LOAD(&r->tail) - head), off;
+
+    *ts = st->phl_us;
+    if (n > size)
+        n = size;
+    off = head & (r->size - 1);
+    if (off + n <= (int)r->size)
+        memcpy(buf, r->data + off, n);
+    else {
+        memcpy(buf, r->data + off, r->size - off);
+        memcpy(buf + r->size - off, r->data, n - (r->size - off));
     }
-    
-    memcpy(buf, rf_head->frame, len);
-
-    next = rf_head->link;
-    if (next == NULL) 
-        rf_tail = NULL;
-    free(rf_head); 
-    rf_head = next;
+    ATOMIC_STORE(&r->head, head + n);
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD(&r->wwait))
+        shm_wake(s, &r->head);
 
-    return len;
+    return n; /* 0 once the peer is gone, see shm_poll() */
 }
 
-int wait_for_event(int *arg)
+static int shm_poll(void)
 {
-    fd_set rfd, wfd;
-    struct timeval tm;
-    int event, n, i;
-    unsigned char ch;
+    struct SHMS *s = st->shm;
 
-    for (;;) {
+    return ((unsigned)ATOMIC_LOAD(&s->rx->tail) != s->rx->head || shm_gone(s) ? PHL_READABLE : 0)
+        | ((unsigned)ATOMIC_LOAD(&s->tx->tail) - (unsigned)ATOMIC_LOAD(&s->tx->head) < s->tx->size ? PHL_WRITABLE : 0);
+}
 
-        now = get_ms();
-     
-        /* commit received socket data */
-        if (rblk_head && rblk_head->commit_ts <= now) {
-            n = rblk_head->wptr - rblk_head->rptr;
-            
-            if (ts0 == 0) {
-                ts0 = now;
-                if (ts0 >= n / 2)
-                    ts0 -= n / 2;
-            }
+static void shm_wait(long long us)
+{
+    struct SHMS *s = st->shm;
+    struct SHM_RING *r = s->rx;
+    unsigned head = r->head;
+    long long end = get_us() + us, left;
+
+    ATOMIC_STORE(&r->rwait, 1);
+    ATOMIC_FENCE();
+    while ((unsigned)ATOMIC_LOAD(&r->tail) == head && !shm_gone(s) && (left = end - get_us()) > 0)
+        shm_sleep(s, &r->tail, head, left < SHM_POLL ? left : SHM_POLL);
+    ATOMIC_STORE(&r->rwait, 0);
+}
 
-            for (i = 0; i < n; i++) {
-                ch = recv_byte();
-                if (ch == 0xff) {
-                    if (rf_buf == NULL) 
-                        rf_buf = (struct RCV_FRAME *)calloc(1, sizeof(struct RCV_FRAME));
-                    else {
-                        if (rf_buf->len > 0) {
-                            if (rf_head == NULL) 
-                                rf_head = rf_tail = rf_buf;
-                            else {
-                                rf_tail->link = rf_buf;
-                                rf_tail = rf_buf;
-                            }
-                            rf_buf = NULL;
-                        }
-                    }
-                } else if (rf_buf && rf_buf->len < sizeof(rf_buf->frame)) {
-                    if (rf_buf->state == 0) {
-                        rf_buf->frame[rf_buf->len] = ch;
-                        rf_buf->state = 1;
-                    } else {
-                        rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
-                        rf_buf->len++;
-                        rf_buf->state = 0;
-                    }
-                }
-            }
+static const struct transport shm_transport = { shm_send, NULL, shm_recv, shm_poll, shm_wait };
 
-            if (rf_head)
-                return FRAME_RECEIVED;
+/* Tell the peer this station quit */
+static void shm_close(struct SHMS *s)
+{
+    ATOMIC_STORE(&s->tx->closed, 1);
+    ATOMIC_FENCE();
+    shm_wake(s, &s->tx->tail);
+}
+
+/* At exit, including an ABORT() */
+static void shm_exit(void)
+{
+    shm_close(shm_self);
+}
+
+/* A creates the mapping, B attaches to it; 0 if either fails */
+static int shm_map(struct SHMS *s)
+{
+    size_t size = shm_layout(NULL, SHM_SIZE, SHM_SIZE);
+    struct SHM *area;
+    char name[64];
+#ifdef _WIN32
+    char ev[64];
+    int i, j;
+
+    sprintf(name, "Local\\datalink-%u", st->port);
+    if (st->station == 'a') {
+        s->map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+        if (s->map != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(s->map);
+            s->map = NULL;
+        }
+    } else
+        s->map = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (s->map == NULL)
+        return 0;
+    area = (struct SHM *)MapViewOfFile(s->map, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (area == NULL)
+        return 0;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            sprintf(ev, "%s-%d", name, i * 2 + j);
+            s->ev[i][j] = st->station == 'a' ? CreateEventA(NULL, FALSE, FALSE, ev)
+                : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, ev);
+            if (s->ev[i][j] == NULL)
+                return 0;
+        }
+    }
+    area->pid[st->station - 'a'] = (int)GetCurrentProcessId();
+#else
+    int fd;
+
+    sprintf(name, "/datalink-%u", st->port);
+    if (st->station == 'a') {
+        shm_unlink(name); /* left by a crashed run */
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 && ftruncate(fd, size) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = shm_open(name, O_RDWR, 0);
+        shm_unlink(name); /* both are attached now */
+    }
+    if (fd < 0)
+        return 0;
+    area = (struct SHM *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED)
+        return 0;
+    area->pid[st->station - 'a'] = (int)getpid();
+#endif
+    if (st->station == 'a')
+        shm_layout(area, SHM_SIZE, SHM_SIZE);
+    s->area = area;
+    return 1;
+}
+
+/* Move the data off the TCP connection if both stations ask for it */
+static int shm_init(void)
+{
+    struct SHMS *s;
+    char ok, peer_ok = 0;
+
+    if (!st->peer_shm) {
+        lprintf("WARNING: Station %s does not use shared memory, using the TCP connection\n",
+            st->station == 'a' ? "B" : "A");
+        return 0;
+    }
+
+    s = (struct SHMS *)calloc(1, sizeof(struct SHMS));
+    if (s == NULL)
+        ABORT("No enough memory");
+
+    /* A maps first, then B; each tells the other how it went */
+    if (st->station == 'a') {
+        ok = (char)shm_map(s);
+        if (send(st->sock, &ok, 1, 0) != 1 || !tcp_read(&peer_ok, 1))
+            ABORT("Station B is gone");
+    } else {
+        if (!tcp_read(&peer_ok, 1))
+            ABORT("Station A is gone");
+        ok = peer_ok && shm_map(s);
+        if (send(st->sock, &ok, 1, 0) != 1)
+            ABORT("Station A is gone");
+    }
+    if (!ok || !peer_ok) {
+        lprintf("WARNING: Failed to share memory with station %s, using the TCP connection\n",
+            st->station == 'a' ? "B" : "A");
+        /* the mapping goes with the process */
+        free(s);
+        return 0;
+    }
+
+    shm_attach(s, s->area, st->station == 'b');
+#ifdef _WIN32
+    s->peer = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)s->area->pid[1 - s->me]);
+    if (s->peer == NULL)
+        ABORT("Failed to watch the peer station");
+#endif
+    st->shm = shm_self = s;
+    st->tp = &shm_transport;
+    atexit(shm_exit);
+
+    return 1;
+}
+
+/* Ring size for the current station's sending, about 100 ms of the channel */
+static unsigned shm_ring_size(void)
+{
+    unsigned size = SHM_MIN, n = (unsigned)chan_scale(SHM_MIN, SHM_SIZE, 100);
+
+    while (size < n)
+        size <<= 1;
+    return size;
+}
+
+/* Join two stations of this process by a pair of rings in the heap */
+static void shm_pair(struct station *a, struct station *b)
+{
+    struct SHMS *s[2];
+    struct SHM *area;
+    unsigned size[2];
+    int i;
+
+    st = a;
+    size[0] = shm_ring_size();
+    st = b;
+    size[1] = shm_ring_size();
+
+    area = (struct SHM *)calloc(1, shm_layout(NULL, size[0], size[1]));
+    s[0] = (struct SHMS *)calloc(1, sizeof(struct SHMS));
+    s[1] = (struct SHMS *)calloc(1, sizeof(struct SHMS));
+    if (area == NULL || s[0] == NULL || s[1] == NULL)
+        ABORT("No enough memory");
+    shm_layout(area, size[0], size[1]);
+
+    for (i = 0; i < 2; i++) {
+        shm_attach(s[i], area, i);
+        s[i]->local = 1;
+    }
+#ifdef _WIN32
+    for (i = 0; i < 4; i++)
+        s[0]->ev[i / 2][i % 2] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    memcpy(s[1]->ev, s[0]->ev, sizeof(s[0]->ev));
+#endif
+    a->shm = s[0];
+    b->shm = s[1];
+    a->tp = b->tp = &shm_transport;
+}
+
+#else
+
+static int shm_init(void)
+{
+    lprintf("WARNING: Shared memory is not supported here, using the TCP connection\n");
+    return 0;
+}
+
+static void shm_pair(struct station *a, struct station *b)
+{
+    ABORT("Stations joined in one process are not supported here");
+}
+
+static void shm_close(struct SHMS *s)
+{
+}
+
+#endif
+
+/* Simulation: both stations in one process on a virtual clock */
+
+/*
+   Station A starts station B by calling main() again in a second thread.
+   Only the station holding the baton runs. A station gives it up when it
+   has nothing to do before its next deadline; the virtual clock then jumps
+   to the earliest deadline of the two stations, so no time is spent
+   waiting. Data in a pipe is stamped with its virtual sending time and
+   only wakes the receiver when it is due to be committed. On a multi-core
+   host the station waiting for the baton spins for a while before it
+   sleeps, since the baton changes hands about every millisecond of virtual
+   time; on a single core spinning would only delay the running station.
+*/
+
+/* Bytes sent at the same virtual time follow a header */
+struct SEGMENT {
+    long long ts;               /* us */
+    int len;
+};
+
+struct PIPE {
+    unsigned char *buf;
+    int size, head, tail;       /* data is buf[head..tail) */
+    int left;                   /* bytes not yet read from the head segment */
+    struct SEGMENT *last;       /* segment at the tail */
+};
+
+/* The stations of the application, as given to link_farm() */
+static void *(*app_open)(struct station *l);
+static void (*app_event)(void *data, int event, int arg);
+
+#define SIM_NEVER 0x7fffffffffffffffLL
+#define SIM_SPIN  20000
+#define sim_me() (st->station - 'a')
+
+static struct {
+    mutex_t lock;
+    cond_t cond;
+    int running;                /* station (0: A, 1: B) holding the baton */
+    int spin;                   /* polls of the baton before sleeping */
+    int done[2];
+    long long deadline[2];      /* us, when a waiting station wants to run */
+    long long blk_delay[2];     /* us, the stations' delay of received data */
+    struct PIPE pipe[2];        /* pipe[0]: A to B, pipe[1]: B to A */
+    int argc;
+    char **argv;
+} sim;
+
+#define pipe_empty(p) ((p)->head == (p)->tail)
+#define pipe_seg(p)   ((struct SEGMENT *)((p)->buf + (p)->head))
+#define seg_align(n)  (((n) + 7) & ~7)
+
+static void pipe_put(struct PIPE *p, const unsigned char *buf, int len, long long ts)
+{
+    int merge = !pipe_empty(p) && p->last->ts == ts;
+    int last = merge ? (int)((unsigned char *)p->last - p->buf) : 0;
+    int need = merge ? len : len + (int)sizeof(struct SEGMENT) + 7;
+
+    if (!merge && p->tail + need > p->size) {
+        memmove(p->buf, p->buf + p->head, p->tail - p->head);
+        p->tail -= p->head;
+        p->head = 0;
+    }
+    if (p->tail + need > p->size) {
+        p->size = (p->tail + need) * 2;
+        p->buf = (unsigned char *)realloc(p->buf, p->size);
+        if (p->buf == NULL)
+            ABORT("No enough memory");
+    }
+
+    if (merge) {
+        p->last = (struct SEGMENT *)(p->buf + last);
+        p->last->len += len;
+        if (p->last == pipe_seg(p))
+            p->left += len;
+    } else {
+        p->tail = seg_align(p->tail);
+        p->last = (struct SEGMENT *)(p->buf + p->tail);
+        p->last->ts = ts;
+        p->last->len = len;
+        if (pipe_empty(p))
+            p->left = len;
+        p->tail += sizeof(struct SEGMENT);
+    }
+    memcpy(p->buf + p->tail, buf, len);
+    p->tail += len;
+}
+
+static int sim_send(const unsigned char *buf, int len)
+{
+    pipe_put(&sim.pipe[sim_me()], buf, len, get_us());
+    return len;
+}
+
+/* Read from one segment only, so that all bytes share its arrival time */
+static int sim_recv(unsigned char *buf, int size, long long *ts)
+{
+    struct PIPE *p = &sim.pipe[1 - sim_me()];
+    struct SEGMENT *seg = pipe_seg(p);
+    int n = p->left, off = seg->len - p->left;
+
+    if (n > size)
+        n = size;
+    *ts = seg->ts;
+    memcpy(buf, (unsigned char *)(seg + 1) + off, n);
+    p->left -= n;
+    if (p->left == 0) {
+        p->head = seg_align(p->head + (int)sizeof(struct SEGMENT) + seg->len);
+        if (p->head > p->tail)
+            p->head = p->tail;
+        if (pipe_empty(p))
+            p->head = p->tail = 0;
+        else
+            p->left = pipe_seg(p)->len;
+    }
+
+    return n;
+}
+
+static int sim_poll(void)
+{
+    return (pipe_empty(&sim.pipe[1 - sim_me()]) ? 0 : PHL_READABLE) | PHL_WRITABLE;
+}
+
+/* Hand the baton to whichever station is due first, 'deadline' (us) is ours */
+static void sim_yield(long long deadline)
+{
+    int me = sim_me(), next, i;
+    long long d[2];
+
+    sim.deadline[me] = deadline;
+    sim.blk_delay[me] = st->blk_delay;
+    for (i = 0; i < 2; i++) {
+        d[i] = sim.done[i] ? SIM_NEVER : sim.deadline[i];
+        /* received data matters once it is due to be committed */
+        if (!sim.done[i] && !pipe_empty(&sim.pipe[1 - i])
+            && pipe_seg(&sim.pipe[1 - i])->ts + sim.blk_delay[i] < d[i])
+            d[i] = pipe_seg(&sim.pipe[1 - i])->ts + sim.blk_delay[i];
+    }
+    next = d[1 - me] <= d[me] ? 1 - me : me;
+
+    if (d[next] == SIM_NEVER) /* both stations quit */
+        exit(0);
+
+    if (d[next] * 1000 > virtual_ns)
+        virtual_ns = d[next] * 1000;
+
+    if (next == me)
+        return;
+
+    mutex_lock(&sim.lock);
+    ATOMIC_STORE(&sim.running, next);
+    cond_broadcast(&sim.cond);
+    mutex_unlock(&sim.lock);
+
+    for (i = 0; i < sim.spin && ATOMIC_LOAD(&sim.running) != me; i++)
+        cpu_relax();
+    if (i == sim.spin) {
+        mutex_lock(&sim.lock);
+        while (ATOMIC_LOAD(&sim.running) != me)
+            cond_wait(&sim.cond, &sim.lock);
+        mutex_unlock(&sim.lock);
+    }
+
+    log_file = st->log;
+}
+
+static void sim_wait(long long us)
+{
+    sim_yield(get_us() + us);
+}
+
+static void sim_quit(void)
+{
+    sim.done[sim_me()] = 1;
+
+    for (;;)
+        sim_yield(SIM_NEVER);
+}
+
+static const struct transport sim_transport = { sim_send, NULL, sim_recv, sim_poll, sim_wait };
+
+THREAD_PROC(sim_station_b)
+{
+    void *data;
+    int event, n;
+
+    (void)arg;
+    mutex_lock(&sim.lock);
+    while (ATOMIC_LOAD(&sim.running) != 1)
+        cond_wait(&sim.cond, &sim.lock);
+    mutex_unlock(&sim.lock);
+
+    optind = 0; /* config() parses the command line again */
+    protocol_init(sim.argc, sim.argv);
+    data = app_open(st);
+    for (;;) {
+        event = wait_for_event(&n);
+        app_event(data, event, n);
+    }
+
+    return 0;
+}
+
+static void sim_init(int argc, char **argv)
+{
+    if (st->station == 'a') {
+        long long base;
+
+        if (app_open == NULL)
+            ABORT("--sim runs station B through the callbacks given to link_farm()");
+        mutex_init(&sim.lock);
+        cond_init(&sim.cond);
+        sim.argc = argc;
+        sim.argv = argv;
+        sim.running = 0;
+        sim.blk_delay[0] = st->blk_delay;
+        sim.blk_delay[1] = chan_blk_delay(st->dir[0].delay, &base); /* till B yields */
+        sim.spin = cpu_count() > 1 ? SIM_SPIN : 0;
+        srand(st->mode_seed);
+        time(&epoch);
+        virtual_ns = 0;
+        thread_create(sim_station_b, NULL);
+    }
+    st->tp = &sim_transport;
+}
+
+/* Create Communication Sockets  */
+
+void protocol_init(int argc, char **argv)
+{
+	socket_init();
+	magic_init();
+
+	st = station_new();
+
+	config(argc, argv);
+	if (!st->mode_sim)
+		tcp_init(); /* the channel parameters may come from the peer */
+	chan_init();
+	pools_init();
+	em_init();
+	trace_init();
+
+	if (st->mode_sim)
+		sim_init(argc, argv);
+	else if (st->mode_shm && shm_init())
+		lprintf("Shared memory transport\n");
+	else if (st->mode_uring && uring_init())
+		lprintf("io_uring transport\n");
+
+    {
+        struct tm *newtime;
+        newtime = localtime(&epoch);
+        lprintf("New epoch: %s", asctime(newtime));
+        lprintf("=================================================================\n\n");
+    }
+
+	if (st->mode_thread)
+		phl_thread_start();
+}
+
+/* Two stations of this process joined by a channel in the heap */
+void link_pair(int argc, char **argv, struct station **a, struct station **b)
+{
+	static int pairs;
+	struct station *s[2];
+	int i;
+
+	if (epoch == 0) { /* no protocol_init() in this process */
+		magic_init();
+		time(&epoch);
+		clock_init();
+	}
+
+	for (i = 0; i < 2; i++) {
+		s[i] = st = station_new();
+		st->station = 'a' + i;
+		st->linked = 1;
+		sprintf(st->name, "%d%c", pairs, 'A' + i);
+		optind = 0; /* config() parses the command line again */
+		config(argc, argv);
+		st->mode_seed += pairs; /* bit errors of its own */
+		chan_init();
+		pools_init();
+		em_init();
+		trace_init();
+	}
+	shm_pair(s[0], s[1]);
+	pairs++;
+
+	*a = s[0];
+	*b = s[1];
+}
+
+/* Physical Layer: Sender */
+
+/*
+   Sending queue structure: a chain of segments taken from sq_pool, so the
+   queue grows with the backlog instead of overflowing. The protocol fills
+   'last' and links a new segment only when it is full; the physical layer
+   drains 'first' and leaves a drained segment only when more bytes follow,
+   so the segment the protocol is linking from is never given back. Each
+   bonded channel has a queue of its own, the segments come from one pool.
+*/
+struct SQSEG {
+    struct SQSEG *link;
+    unsigned char data[1];
+};
+
+static int sq_chan_len(struct SQCHAN *q)
+{
+    return (int)(ATOMIC_LOAD(&q->in) - ATOMIC_LOAD(&q->out));
+}
+
+/* Bytes queued on all channels */
+static int sq_len(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < st->bond; i++)
+        n += sq_chan_len(&st->sq[i]);
+    return n;
+}
+
+int phl_sq_len(void)
+{
+    return sq_len();
+}
+
+/* Bytes queued on the channel the next frame goes to, what PHYSICAL_LAYER_READY goes by */
+static int sq_ready_len(void)
+{
+    return st->bond > 1 ? sq_chan_len(&st->sq[bond_policies[st->bond_policy].next()]) : sq_len();
+}
+
+/* Split each byte into its low and high nibble: dst[2i] = low, dst[2i+1] = high */
+static void nibble_expand(unsigned char *dst, const unsigned char *src, int n)
+{
+    int i = 0;
+
+#ifdef __AVX2__
+    const __m256i mask32 = _mm256_set1_epi8(0x0f);
+    __m256i v, lo, hi;
+
+    for (; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        lo = _mm256_and_si256(v, mask32);
+        hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask32);
+        v = _mm256_unpacklo_epi8(lo, hi);  /* bytes 0-7 | 16-23 */
+        hi = _mm256_unpackhi_epi8(lo, hi); /* bytes 8-15 | 24-31 */
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_permute2x128_si256(v, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * i + 32), _mm256_permute2x128_si256(v, hi, 0x31));
+    }
+#endif
+#ifdef HAVE_SSE2
+    {
+        const __m128i mask16 = _mm_set1_epi8(0x0f);
+        __m128i x, l, h;
+
+        for (; i + 16 <= n; i += 16) {
+            x = _mm_loadu_si128((const __m128i *)(src + i));
+            l = _mm_and_si128(x, mask16);
+            h = _mm_and_si128(_mm_srli_epi16(x, 4), mask16);
+            _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(l, h));
+            _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(l, h));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        dst[2 * i] = src[i] & 0x0f;
+        dst[2 * i + 1] = (src[i] & 0xf0) >> 4;
+    }
+}
+
+/* Send 'n' bytes from the head of the sending queue 'q' */
+static int sq_send(struct SQCHAN *q, int n)
+{
+    struct SQSEG *seg = q->first, *next;
+    int off = q->rptr, len1, len2, ret, sent = 0, i = (int)(q - st->sq);
+    unsigned char sw = 0;
+
+    /* tell the peer that the bytes of channel i follow, along with the first ones if sendv() can */
+    if (st->bond > 1 && st->bond_tx != i) {
+        sw = (unsigned char)(BOND_SWITCH + i);
+        if (st->tp->sendv == NULL) {
+            ret = st->tp->send(&sw, 1);
+            st->tx_calls++;
+            if (ret < 0) {
+                lprintf("TCP Disconnected.\n");
+                exit(0);
+            }
+            if (ret == 0)
+                return 0;
+            st->bond_tx = i;
+            sw = 0;
+        }
+    }
+
+    while (n > 0) {
+        if (off == st->sq_seg) {
+            next = seg->link;
+            pool_return(&st->sq_pool, seg);
+            seg = next;
+            off = 0;
+        }
+
+        len1 = st->sq_seg - off;
+        if (sw) {
+            if (len1 > n)
+                len1 = n;
+            ret = st->tp->sendv(&sw, 1, seg->data + off, len1);
+            if (ret > 0) {
+                st->bond_tx = i;
+                sw = 0;
+                ret--;
+            }
+        } else if (len1 >= n || st->tp->sendv == NULL) {
+            if (len1 > n)
+                len1 = n;
+            ret = st->tp->send(seg->data + off, len1);
+        } else {
+            len2 = n - len1 < st->sq_seg ? n - len1 : st->sq_seg;
+            ret = st->tp->sendv(seg->data + off, len1, seg->link->data, len2);
+            st->tx_saved++;
+            len1 += len2;
+        }
+        st->tx_calls++;
+        if (ret < 0) {
+            lprintf("TCP Disconnected.\n");
+            exit(0);
+        }
+
+        sent += ret;
+        n -= ret;
+        off += ret;
+        if (off > st->sq_seg) {
+            next = seg->link;
+            pool_return(&st->sq_pool, seg);
+            seg = next;
+            off -= st->sq_seg;
+        }
+        if (ret < len1)
+            break;
+    }
+
+    q->first = seg;
+    q->rptr = off;
+    ATOMIC_STORE(&q->out, q->out + sent);
+
+    return sent;
+}
+
+/*
+   Token bucket of the sending channel. The credit is kept in us * bps and a
+   byte costs TB_BYTE (4 bits, 2 bytes per octet), so no fraction of a byte
+   is lost between refills. Once the queue has run empty the credit is capped
+   at tb_burst bytes, the most that goes out at once. While it is backlogged
+   the bytes are written a flush unit (send_chunk, a tick's worth) at a time,
+   and the credit may run a flush unit and one poll interval beyond tb_burst,
+   so a wakeup that comes late still sends at exactly chan_bps; only a longer
+   stall loses rate rather than turning into a burst. Every bonded channel
+   has a bucket of its own.
+*/
+#define TB_BYTE 4000000LL
+
+/* Returns the whole bytes that may be sent now */
+static int tb_refill(struct SQCHAN *q)
+{
+    long long dt, cap;
+
+    if (q->send_ts == 0)
+        q->send_ts = st->phl_us;
+
+    cap = (st->tb_burst + (q->tb_idle ? 0 : 2 * st->send_chunk)) * (long long)TB_BYTE;
+    dt = st->phl_us - q->send_ts;
+    if (dt > 0) {
+        q->send_ts = st->phl_us;
+        if (dt >= cap / st->chan_bps)
+            q->tb_credit = cap;
+        else
+            q->tb_credit += dt * st->chan_bps;
+    }
+    if (q->tb_credit > cap)
+        q->tb_credit = cap;
+
+    return (int)(q->tb_credit / TB_BYTE);
+}
+
+/* Send up to 'n' bytes from the queue against the credit */
+static void tb_send(struct SQCHAN *q, int n)
+{
+    n = sq_send(q, n);
+    st->tx_bytes += n;
+    q->tb_credit -= n * TB_BYTE;
+    q->tb_idle = sq_chan_len(q) == 0;
+}
+
+/* Bytes worth a send call: the queue, but no more than the burst or the flush unit */
+static int tb_want(struct SQCHAN *q)
+{
+    int n = sq_chan_len(q), unit = q->tb_idle ? st->tb_burst : st->send_chunk;
+
+    return n < unit ? n : unit;
+}
+
+/* Send what the credit allows once it covers tb_want(), returns whether a write was made */
+static int tb_try(struct SQCHAN *q)
+{
+    int n, allowed = tb_refill(q);
+
+    if ((n = sq_chan_len(q)) == 0 || allowed < tb_want(q))
+        return 0;
+    tb_send(q, n < allowed ? n : allowed);
+    return 1;
+}
+
+/* Channel policies of send_frame(), see bond_policies[] */
+static int bond_rr(void)
+{
+    return st->bond_rr;
+}
+
+/* The channel with the fewest bytes queued, the round robin breaks ties */
+static int bond_lq(void)
+{
+    int i, k, n, best = -1, min = 0;
+
+    for (i = 0; i < st->bond; i++) {
+        k = (st->bond_rr + i) % st->bond;
+        n = sq_chan_len(&st->sq[k]);
+        if (best < 0 || n < min) {
+            best = k;
+            min = n;
+        }
+    }
+    return best;
+}
+
+/* 
+   The frame is encoded straight into the sending queue: 0xff, the nibbles
+   of every byte, 0xff, with the sequence number after the first 0xff on
+   bonded channels. Only a byte that straddles two segments is written
+   by hand. The bytes are published once the frame is complete.
+*/
+static void sq_grow(struct SQCHAN *q)
+{
+    struct SQSEG *seg = (struct SQSEG *)pool_get(&st->sq_pool);
+
+    seg->link = NULL;
+    q->last->link = seg;
+    q->last = seg;
+    q->wptr = 0;
+}
+
+static void sq_byte(struct SQCHAN *q, unsigned char c)
+{
+    if (q->wptr == st->sq_seg)
+        sq_grow(q);
+    q->last->data[q->wptr++] = c;
+}
+
+static void sq_put(unsigned char *buf, int len)
+{
+    struct SQCHAN *q = &st->sq[st->bond_cur];
+    int n;
+
+    while (len > 0) {
+        if (q->wptr == st->sq_seg)
+            sq_grow(q);
+
+        n = (st->sq_seg - q->wptr) / 2;
+        if (n > len)
+            n = len;
+        nibble_expand(q->last->data + q->wptr, buf, n);
+        q->wptr += 2 * n;
+        buf += n;
+        len -= n;
+
+        if (len > 0 && q->wptr == st->sq_seg - 1) {
+            q->last->data[q->wptr] = buf[0] & 0x0f;
+            sq_grow(q);
+            q->last->data[0] = (buf[0] & 0xf0) >> 4;
+            q->wptr = 1;
+            buf++;
+            len--;
+        }
+    }
+}
+
+/* Opens a frame of 'len' bytes on the channel the policy chooses, returns whether it was idle */
+static int sq_begin(int len)
+{
+    struct SQCHAN *q;
+    int i;
+
+    st->inform_phl_ready = 1;
+    if (st->bond > 1) {
+        st->bond_cur = bond_policies[st->bond_policy].next();
+        st->bond_rr = (st->bond_cur + 1) % st->bond;
+    }
+    q = &st->sq[st->bond_cur];
+    sq_byte(q, 0xff);
+    if (st->bond > 1 && len > 0) { /* an empty frame is dropped by the receiver, it takes no number */
+        for (i = 0; i < BOND_HDR; i++)
+            sq_byte(q, (unsigned char)(BOND_SEQ + (st->bond_seq >> 4 * i & 0x0f)));
+        st->bond_seq++;
+    }
+    return sq_chan_len(q) == 0;
+}
+
+static void sq_end(int was_empty, int len)
+{
+    struct SQCHAN *q = &st->sq[st->bond_cur];
+    int n;
+
+    sq_byte(q, 0xff);
+    ATOMIC_STORE(&q->in, q->in + 2 * len + 2 + (st->bond > 1 && len > 0 ? BOND_HDR : 0));
+
+    q->frames++;
+    st->tx_frames++;
+    n = sq_len();
+    if (n > st->sq_peak)
+        st->sq_peak = n;
+    if (sq_ready_len() >= st->sq_high)
+        st->sq_full = 1;
+
+    /* the credit left over from the last socket_send() goes out with sq_flush() */
+    if (!st->mode_thread && q->tb_credit >= TB_BYTE && (was_empty || st->sq_flush))
+        st->sq_flush++;
+}
+
+/*
+   Frames sent by one event handler are written together, so a burst costs
+   one send call instead of one per frame. Called before the protocol waits.
+*/
+static void sq_flush(void)
+{
+    int i, sent = 0;
+
+    if (st->sq_flush == 0)
+        return;
+
+    for (i = 0; i < st->bond; i++)
+        sent |= tb_try(&st->sq[i]);
+    if (sent) /* written together, one call at least */
+        st->tx_saved += st->sq_flush - 1;
+    st->sq_flush = 0;
+}
+
+static void send_report(void)
+{
+    int i;
+
+    lprintf("Socket writes: %lld frames, %lld send calls (%.2f per frame, %.0f bytes each, flush unit %d), %lld calls saved by coalescing\n",
+        st->tx_frames, st->tx_calls, st->tx_frames ? (double)st->tx_calls / st->tx_frames : 0.0,
+        st->tx_calls ? (double)st->tx_bytes / st->tx_calls : 0.0, st->send_chunk, st->tx_saved);
+    if (st->bond > 1) {
+        lprintf("Bonded channels (%s): frames", bond_policies[st->bond_policy].name);
+        for (i = 0; i < st->bond; i++)
+            lprintf(" %lld", st->sq[i].frames);
+        lprintf("\n");
+    }
+}
+
+void send_frame(unsigned char *frame, int len)
+{
+    int was_empty = sq_begin(len);
+
+    sq_put(frame, len);
+    sq_end(was_empty, len);
+}
+
+/*
+   Scatter-gather variant: the frame is a header followed by a payload that
+   stays in the caller's buffer. The CRC-32 is computed over both segments
+   and appended in host byte order, as datalink does with crc32(), so a
+   retransmission encodes the payload without copying it first.
+*/
+void send_frame_iov(unsigned char *head, int hlen, unsigned char *data, int dlen)
+{
+    unsigned int crc;
+    int was_empty;
+
+    crc = crc32_update(0xffffffff, head, hlen);
+    crc = crc32_update(crc, data, dlen);
+
+    was_empty = sq_begin(hlen + dlen + 4);
+    sq_put(head, hlen);
+    sq_put(data, dlen);
+    sq_put((unsigned char *)&crc, 4);
+    sq_end(was_empty, hlen + dlen + 4);
+}
+
+static void socket_send(void)
+{
+    int i;
+
+    for (i = 0; i < st->bond; i++)
+        tb_try(&st->sq[i]);
+}
+
+/* Physical Layer: Receiver */
+
+struct BLK {
+    long long commit_ts; /* us */
+    int rptr, wptr;
+    struct BLK *link;
+    unsigned char data[1]; /* blksize bytes */
+};
+
+struct RCV_FRAME {
+    int len;
+    int state;
+    int cap;
+    long long ts;           /* release time (us) when held back */
+    int seq;                /* sequence number on bonded channels, -1: none */
+    struct RCV_FRAME *link;
+    unsigned char frame[1]; /* cap bytes */
+};
+
+#define RF_SMALL 64   /* ACK, NAK and other control frames */
+#define RF_LARGE 2048 /* longest frame kept */
+#define rf_size(cap) ((int)sizeof(struct RCV_FRAME) - 1 + (cap))
+
+/* Receive buffer pools */
+
+/*
+   BLKs and RCV_FRAMEs are taken from per-station free lists. Each pool
+   starts with one slab; when it runs dry an object is taken from the heap
+   and counted, and it joins the pool once it is given back, so steady
+   traffic runs without heap allocation. In --thread mode frames are freed
+   by the protocol thread: pool_return() hands them back through a
+   single-producer/single-consumer ring that pool_get() drains, so the
+   physical layer thread itself frees with pool_put() only. What does
+   not fit waits in 'over' until the ring has room again, as a slab member
+   must never reach free(). With one thread it is simply pool_put().
+*/
+
+static void pool_init(struct POOL *p, int size, int n)
+{
+    unsigned char *slab;
+    int i;
+
+    p->size = (size + 7) & ~7;
+    slab = (unsigned char *)malloc((size_t)p->size * n);
+    if (slab == NULL)
+        ABORT("No enough memory");
+    for (i = 0; i < n; i++) {
+        *(void **)(slab + i * p->size) = p->free;
+        p->free = slab + i * p->size;
+    }
+}
+
+static void *pool_get(struct POOL *p)
+{
+    void *obj;
+    int tail = ATOMIC_LOAD(&p->ret_tail);
+
+    while (p->ret_head != tail) {
+        obj = p->ret[p->ret_head];
+        *(void **)obj = p->free;
+        p->free = obj;
+        ATOMIC_STORE(&p->ret_head, (p->ret_head + 1) % POOL_RET);
+    }
+
+    p->gets++;
+    if ((obj = p->free) != NULL) {
+        p->free = *(void **)obj;
+        return obj;
+    }
+
+    p->heap++;
+    obj = malloc(p->size);
+    if (obj == NULL)
+        ABORT("No enough memory");
+    return obj;
+}
+
+/* Give back from the thread that calls pool_get() */
+static void pool_put(struct POOL *p, void *obj)
+{
+    *(void **)obj = p->free;
+    p->free = obj;
+}
+
+/* Give back from the other thread */
+static void pool_return(struct POOL *p, void *obj)
+{
+    int tail = p->ret_tail;
+
+    if (!st->mode_thread) {
+        pool_put(p, obj);
+        return;
+    }
+
+    *(void **)obj = p->over;
+    p->over = obj;
+    while (p->over && (tail + 1) % POOL_RET != ATOMIC_LOAD(&p->ret_head)) {
+        obj = p->over;
+        p->over = *(void **)obj;
+        p->ret[tail] = obj;
+        tail = (tail + 1) % POOL_RET;
+    }
+    ATOMIC_STORE(&p->ret_tail, tail);
+}
+
+static struct RCV_FRAME *rf_get(struct POOL *p)
+{
+    struct RCV_FRAME *rf = (struct RCV_FRAME *)pool_get(p);
+
+    rf->len = rf->state = 0;
+    rf->seq = -1;
+    rf->cap = p == &st->rf_small ? RF_SMALL : RF_LARGE;
+    return rf;
+}
+
+static void rf_free(struct RCV_FRAME *rf)
+{
+    pool_return(rf->cap == RF_SMALL ? &st->rf_small : &st->rf_large, rf);
+}
+
+#define BLK_SLAB (1024 * 1024) /* bytes in the first slab of BLKs */
+
+static void pools_init(void)
+{
+    int i, n = BLK_SLAB / ((int)sizeof(struct BLK) - 1 + st->blksize);
+
+    pool_init(&st->blk_pool, (int)sizeof(struct BLK) - 1 + st->blksize, n < 8 ? 8 : n > 512 ? 512 : n);
+    pool_init(&st->rf_small, rf_size(RF_SMALL), 32);
+    pool_init(&st->rf_large, rf_size(RF_LARGE), 32);
+
+    pool_init(&st->sq_pool, (int)sizeof(struct SQSEG) - 1 + st->sq_seg, 4);
+    for (i = 0; i < st->bond; i++) {
+        st->sq[i].first = st->sq[i].last = (struct SQSEG *)pool_get(&st->sq_pool);
+        st->sq[i].first->link = NULL;
+    }
+    if (st->rx_bond > 1 && (st->bond_held = (struct RCV_FRAME **)calloc(BOND_WIN, sizeof(struct RCV_FRAME *))) == NULL)
+        ABORT("No enough memory");
+}
+
+static void pool_report(void)
+{
+    lprintf("Receive pools: BLK %d/%d, small frame %d/%d, large frame %d/%d taken from the heap\n",
+        st->blk_pool.heap, st->blk_pool.gets, st->rf_small.heap, st->rf_small.gets, 
+        st->rf_large.heap, st->rf_large.gets);
+    lprintf("Sending queue: peak %d bytes, %d-byte segment %d/%d taken from the heap\n",
+        st->sq_peak, st->sq_seg, st->sq_pool.heap, st->sq_pool.gets);
+}
+
+#define rfq_len()  ((ATOMIC_LOAD(&st->rfq_tail) + RFQ_SIZE - ATOMIC_LOAD(&st->rfq_head)) % RFQ_SIZE)
+#define rfq_full() (rfq_len() == RFQ_SIZE - 1)
+
+static void rfq_put(struct RCV_FRAME *rf)
+{
+    st->rfq[st->rfq_tail] = rf;
+    ATOMIC_STORE(&st->rfq_tail, (st->rfq_tail + 1) % RFQ_SIZE);
+}
+
+
+/*
+   Bit errors of the received data. An error model returns the number of
+   data bits (4 per channel byte) to skip before the next error, so the cost
+   is per error rather than per bit or per block, and any number of errors
+   can land in one block. The draws come from a per-station xoshiro256**
+   generator; the logarithms of the geometric skips use em_ln[] computed
+   once by em_init() and fast_ln(), so libm is not called per error.
+*/
+struct errmodel {
+    const char *name;
+    long long (*next)(void);
+};
+
+#define EM_NEVER (1LL << 62)
+
+static unsigned long long rotl64(unsigned long long x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static unsigned long long xoshiro(void)
+{
+    unsigned long long *s = st->rng, r = rotl64(s[1] * 5, 7) * 9, t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+    return r;
+}
+
+/* ln(x) for 0 < x <= 1 from the exponent and a series in (m-1)/(m+1) */
+static double fast_ln(double x)
+{
+    union { double d; unsigned long long u; } v;
+    double m, t, t2;
+    int e;
+
+    v.d = x;
+    e = (int)((v.u >> 52) & 0x7ff) - 1023;
+    v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    m = v.d;
+    if (m > 1.41421356237) {
+        m *= 0.5;
+        e++;
+    }
+    t = (m - 1.0) / (m + 1.0);
+    t2 = t * t;
+    return e * 0.69314718055994531 + 2.0 * t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 * (1.0 / 9)))));
+}
+
+/* Bits before the next event of probability x per bit, inv = 1 / ln(1 - x) */
+static long long geometric(double inv)
+{
+    double u = ((xoshiro() >> 11) + 1) * (1.0 / 9007199254740992.0); /* (0, 1] */
+    double n = fast_ln(u) * inv;
+
+    return inv == 0.0 || n >= EM_NEVER ? EM_NEVER : (long long)n;
+}
+
+/* Uniform in [0, 1) */
+static double rng_uniform(void)
+{
+    return (xoshiro() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long long em_iid_next(void)
+{
+    return geometric(st->em_ln[0]);
+}
+
+/* Each state lasts a geometric number of bits, and errors within it are i.i.d. */
+static long long em_ge_next(void)
+{
+    long long skip = 0, n;
+
+    for (;;) {
+        n = geometric(st->em_ln[st->ge_bad ? 2 : 3]);
+        if (n < st->ge_left) {
+            st->ge_left -= n + 1;
+            return skip + n;
+        }
+        skip += st->ge_left;
+        st->ge_bad = !st->ge_bad;
+        st->ge_left = geometric(st->em_ln[st->ge_bad ? 1 : 0]) + 1;
+    }
+}
+
+static const struct errmodel em_iid = { "i.i.d.", em_iid_next };
+static const struct errmodel em_ge = { "Gilbert-Elliott", em_ge_next };
+
+static double em_inv_ln(double x)
+{
+    return x > 0.0 ? 1.0 / log(1.0 - x) : 0.0;
+}
+
+static void em_init(void)
+{
+    unsigned long long z = (unsigned long long)st->mode_seed << 8 ^ st->station;
+    int i;
+
+    /* splitmix64 */
+    for (i = 0; i < 4; i++) {
+        z += 0x9e3779b97f4a7c15ULL;
+        st->rng[i] = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        st->rng[i] = (st->rng[i] ^ (st->rng[i] >> 27)) * 0x94d049bb133111ebULL;
+        st->rng[i] ^= st->rng[i] >> 31;
+    }
+
+    if (st->ge_p > 0.0) {
+        st->em = &em_ge;
+        st->em_ln[0] = em_inv_ln(st->ge_p);
+        st->em_ln[1] = em_inv_ln(st->ge_r);
+        st->em_ln[2] = em_inv_ln(st->ge_h);
+        st->em_ln[3] = em_inv_ln(st->ge_k);
+        st->ge_left = geometric(st->em_ln[0]) + 1;
+    } else if (st->ber > 0.0) {
+        st->em = &em_iid;
+        st->em_ln[0] = em_inv_ln(st->ber);
+    } else
+        return;
+    st->em_skip = st->em->next();
+}
+
+/*
+   Channel trace: lines of "<ms> [bps=<bps>] [delay=<ms>] [ber=<ber>]" in
+   time order, '#' starts a comment. The file is read one entry ahead, and
+   trace_step() applies the entry once the physical layer clock reaches it.
+   The token bucket is refilled at the old rate first; a new delay holds
+   for data received from then on; a BER replaces the error model by i.i.d.
+   errors at that rate.
+*/
+static void trace_next(void)
+{
+    char line[256], key[32], *p;
+    double t, v;
+    int n;
+
+    while (fgets(line, sizeof(line), st->trace)) {
+        if ((p = strchr(line, '#')) != NULL)
+            *p = 0;
+        if (sscanf(line, "%lf%n", &t, &n) != 1)
+            continue;
+
+        st->trace_ts = (long long)(t * 1000);
+        st->tr_bps = -1;
+        st->tr_delay = -1;
+        st->tr_ber = -1.0;
+        for (p = line + n; sscanf(p, " %31[^= \t\r\n]=%lf%n", key, &v, &n) == 2; p += n) {
+            if (stricmp(key, "bps") == 0 && v >= 100 && v <= 2.0E9)
+                st->tr_bps = (int)v;
+            else if (stricmp(key, "delay") == 0 && v >= 0)
+                st->tr_delay = (long long)(v * 1000);
+            else if (stricmp(key, "ber") == 0 && v >= 0 && v < 1.0)
+                st->tr_ber = v;
+            else
+                lprintf("** WARNING: Ignoring \"%s=%g\" in channel trace\n", key, v);
+        }
+        return;
+    }
+
+    fclose(st->trace);
+    st->trace = NULL;
+}
+
+static void trace_init(void)
+{
+    if (st->trace) {
+        trace_next();
+        lprintf("Channel trace%s\n", st->trace ? "" : " is empty");
+    }
+}
+
+static void trace_step(void)
+{
+    int i;
+
+    while (st->trace && st->trace_ts <= st->phl_us) {
+        if (st->tr_bps > 0) {
+            for (i = 0; i < st->bond; i++)
+                tb_refill(&st->sq[i]);
+            st->chan_bps = st->tr_bps;
+            chan_rate(); /* the pools keep the segment and block sizes of the start */
+        }
+        if (st->tr_delay >= 0) {
+            st->chan_delay = st->tr_delay;
+            st->blk_delay = chan_blk_delay(st->chan_delay, &st->imp_base);
+        }
+        if (st->tr_ber >= 0.0) {
+            st->ber = st->tr_ber;
+            st->em_ln[0] = em_inv_ln(st->ber);
+            st->em = st->ber > 0.0 ? &em_iid : NULL;
+            if (st->em)
+                st->em_skip = st->em->next();
+        }
+        lprintf("Channel trace: %d bps, %g ms propagation delay, bit error rate %.1E\n",
+            st->chan_bps, st->chan_delay / 1000.0, st->em == &em_iid ? st->ber : 0.0);
+        trace_next();
+    }
+}
+
+/* Flip the data bits the error model hits in the block, delimiters and bonding bytes are spared */
+static void em_apply(struct BLK *blk)
+{
+    long long bits = blk->wptr * 4LL;
+    unsigned char *p;
+
+    while (st->em_skip < bits) {
+        p = &blk->data[st->em_skip >> 2];
+        if (*p < BOND_SEQ) {
+            *p ^= 1 << (st->em_skip & 3);
+            st->noise++;
+            dbg_warning("Impose noise on received data, %u/%lld=%.1E\n", st->noise, st->nbits, (double)st->noise / st->nbits);
+        }
+        st->em_skip += st->em->next() + 1;
+    }
+    st->em_skip -= bits;
+}
+
+/* Returns 1 if the block is full, so that more data may be waiting */
+static int socket_recv(void)
+{
+    struct BLK *blk;
+
+    blk = (struct BLK *)pool_get(&st->blk_pool);
+
+    blk->rptr = 0;
+    blk->wptr = st->tp->recv(blk->data, st->blksize, &blk->commit_ts);
+    if (blk->wptr <= 0) {
+        if (!st->linked) {
+            lprintf("TCP disconnected.\n");
+            exit(0);
+        }
+        lprintf("Station %s quit.\n", st->station == 'a' ? "B" : "A");
+        pool_put(&st->blk_pool, blk);
+        st->quit = 1;
+        return 0;
+    }
+    st->nbits += blk->wptr * 4;
+
+    /* Impose noise */
+    if (st->em)
+        em_apply(blk);
+
+    blk->commit_ts += st->blk_delay;
+    blk->link = NULL; 
+
+    if (st->rblk_head == NULL) 
+        st->rblk_head = st->rblk_tail = blk;
+    else {
+        st->rblk_tail->link = blk;
+        st->rblk_tail = blk;
+    }
+
+    return blk->wptr == st->blksize;
+}
+
+/* Read what the socket has, up to RECV_BURST blocks */
+static void socket_recv_burst(void)
+{
+    int i;
+
+    for (i = 1; socket_recv() && i < RECV_BURST && (st->tp->poll() & PHL_READABLE); i++)
+        ;
+}
+
+/*
+   Join 'n' nibble pairs into bytes: low | ((high & 0x0f) ^ (high >> 4)) << 4.
+   A bit error in the upper half of a nibble byte is kept, as the byte-wise
+   decoder always did. The vector versions work on 16-bit lanes (one pair
+   each) and pack the results.
+*/
+static void nibble_merge(unsigned char *dst, const unsigned char *src, int n)
+{
+    int i = 0;
+
+#ifdef __AVX2__
+    const __m256i lo_mask32 = _mm256_set1_epi16(0x00ff), nib_mask32 = _mm256_set1_epi16(0x000f);
+    __m256i a, b;
+
+    for (; i + 32 <= n; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+        b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+        a = _mm256_or_si256(_mm256_and_si256(a, lo_mask32), _mm256_slli_epi16(_mm256_and_si256(
+            _mm256_xor_si256(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(a, 12)), nib_mask32), 4));
+        b = _mm256_or_si256(_mm256_and_si256(b, lo_mask32), _mm256_slli_epi16(_mm256_and_si256(
+            _mm256_xor_si256(_mm256_srli_epi16(b, 8), _mm256_srli_epi16(b, 12)), nib_mask32), 4));
+        /* packus works per 128-bit lane, put the quarters back in order */
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+#endif
+#ifdef HAVE_SSE2
+    {
+        const __m128i lo_mask16 = _mm_set1_epi16(0x00ff), nib_mask16 = _mm_set1_epi16(0x000f);
+        __m128i x, y;
+
+        for (; i + 16 <= n; i += 16) {
+            x = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            y = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+            x = _mm_or_si128(_mm_and_si128(x, lo_mask16), _mm_slli_epi16(_mm_and_si128(
+                _mm_xor_si128(_mm_srli_epi16(x, 8), _mm_srli_epi16(x, 12)), nib_mask16), 4));
+            y = _mm_or_si128(_mm_and_si128(y, lo_mask16), _mm_slli_epi16(_mm_and_si128(
+                _mm_xor_si128(_mm_srli_epi16(y, 8), _mm_srli_epi16(y, 12)), nib_mask16), 4));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(x, y));
+        }
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = src[2 * i] | (((src[2 * i + 1] & 0x0f) ^ (src[2 * i + 1] >> 4)) << 4);
+}
+
+/* Append 'n' nibble bytes (no 0xff among them) to the frame being received */
+static void rf_append(const unsigned char *src, int n)
+{
+    struct RCV_FRAME *rf = st->rf_buf, *big;
+    int cap = rf->cap, pairs;
+
+    /* outgrowing a small buffer: move to a large one */
+    if (cap < RF_LARGE && rf->len + (rf->state + n + 1) / 2 > cap) {
+        big = rf_get(&st->rf_large);
+        memcpy(big, rf, rf_size(rf->len + 1) < rf_size(cap) ? rf_size(rf->len + 1) : rf_size(cap));
+        big->cap = cap = RF_LARGE;
+        pool_put(&st->rf_small, rf);
+        st->rf_buf = rf = big;
+    }
+
+    if (n == 0 || rf->len >= cap)
+        return;
+
+    if (rf->state == 1) {
+        rf->frame[rf->len] |= ((src[0] & 0x0f) ^ (src[0] >> 4)) << 4;
+        rf->len++;
+        rf->state = 0;
+        src++;
+        n--;
+    }
+
+    pairs = n / 2;
+    if (pairs > cap - rf->len)
+        pairs = cap - rf->len;
+    nibble_merge(rf->frame + rf->len, src, pairs);
+    rf->len += pairs;
+
+    if (n > 2 * pairs && rf->len < cap) {
+        rf->frame[rf->len] = src[2 * pairs];
+        rf->state = 1;
+    }
+}
+
+/* Timer Management */
+
+/*
+   Hierarchical timing wheel (100 us ticks):
+     level 0: 256 slots x 1 tick, level 1: 64 slots x 256 ticks, level 2: 64 slots x 16384 ticks
+   Timers beyond the range of level 2 (~100 s) are parked in its farthest slot
+   and re-sorted when it is cascaded. Start/stop are O(1), expiry is O(expired).
+*/
+
+#define tw_empty(h) ((h)->next == (h) || (h)->next == NULL)
+#define TW_WHEEL   1
+#define TW_EXPIRED 2
+
+static void tw_link(struct TIMER *h, struct TIMER *t)
+{
+    if (h->next == NULL)
+        h->next = h->prev = h;
+    t->prev = h->prev;
+    t->next = h;
+    h->prev->next = t;
+    h->prev = t;
+}
+
+static void tw_unlink(struct TIMER *t)
+{
+    if (!t->queued)
+        return;
+    if (t->queued == TW_WHEEL)
+        st->tw_pending--;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->queued = 0;
+}
+
+static void tw_add(struct TIMER *t)
+{
+    long long delta = t->expire - st->tw_ts;
+    int idx;
+
+    if (delta <= 0) {
+        t->queued = TW_EXPIRED;
+        tw_link(&st->expired, t);
+        return;
+    }
+
+    t->queued = TW_WHEEL;
+    st->tw_pending++;
+    if (delta < TW0_SIZE) {
+        idx = (int)(t->expire & TW0_MASK);
+        st->tw0_map[idx / 32] |= 1u << (idx % 32);
+        tw_link(&st->tw0[idx], t);
+    } else if (delta < 1 << TW2_SHIFT)
+        tw_link(&st->tw1[(t->expire >> TW1_SHIFT) & TW_MASK], t);
+    else {
+        if (delta >= (long long)TW_MASK << TW2_SHIFT)
+            delta = (long long)TW_MASK << TW2_SHIFT;
+        tw_link(&st->tw2[((st->tw_ts + delta) >> TW2_SHIFT) & TW_MASK], t);
+    }
+}
+
+/* Re-sort all timers of a higher-level slot into the wheel */
+static void tw_cascade(struct TIMER *h)
+{
+    struct TIMER *t;
+
+    while (!tw_empty(h)) {
+        t = h->next;
+        tw_unlink(t);
+        tw_add(t);
+    }
+}
+
+/* Move every timer due at or before tick 'ts' to the expired list */
+static void tw_advance(long long ts)
+{
+    int idx;
+
+    if (st->tw_pending == 0) {
+        if (ts > st->tw_ts)
+            st->tw_ts = ts;
+        return;
+    }
+
+    while (st->tw_ts < ts) {
+        st->tw_ts++;
+        idx = (int)(st->tw_ts & TW0_MASK);
+        if (idx == 0) {
+            if (((st->tw_ts >> TW1_SHIFT) & TW_MASK) == 0)
+                tw_cascade(&st->tw2[(st->tw_ts >> TW2_SHIFT) & TW_MASK]);
+            tw_cascade(&st->tw1[(st->tw_ts >> TW1_SHIFT) & TW_MASK]);
+        }
+        if (st->tw0_map[idx / 32] & (1u << (idx % 32))) {
+            st->tw0_map[idx / 32] &= ~(1u << (idx % 32));
+            tw_cascade(&st->tw0[idx]);
+        }
+        if (st->tw_pending == 0 && ts > st->tw_ts)
+            st->tw_ts = ts;
+    }
+}
+
+static void tw_start(unsigned int nr, long long expire_us)
+{
+    tw_unlink(&st->timer[nr]);
+    st->timer[nr].expire = (expire_us + TW_TICK_US - 1) / TW_TICK_US;
+    if (st->timer[nr].expire == 0)
+        st->timer[nr].expire = 1;
+    tw_add(&st->timer[nr]);
+}
+
+static void tw_stop(unsigned int nr)
+{
+    tw_unlink(&st->timer[nr]);
+    st->timer[nr].expire = 0;
+}
+
+void start_timer(unsigned int nr, unsigned int ms)
+{
+    char msg[64];
+
+    if (nr >= ACK_TIMER_ID) {
+        sprintf(msg, "start_timer(): timer No. must be 0~%d", ACK_TIMER_ID - 1);
+        ABORT(msg);
+    }
+    tw_start(nr, st->now_us + (long long)phl_sq_len() * 8000000 / ((long long)st->chan_bps * st->bond) + ms * 1000LL);
+}
+
+void stop_timer(unsigned int nr)
+{
+    if (nr < ACK_TIMER_ID) 
+        tw_stop(nr);
+}
+
+int get_timer(unsigned int nr)
+{
+    long long left;
+
+    if (nr >= ACK_TIMER_ID || st->timer[nr].expire == 0)
+        return 0;
+    left = st->timer[nr].expire * TW_TICK_US - st->now_us;
+    return left > 0 ? (int)(left / 1000) : 0;
+}
+
+void start_ack_timer(unsigned int ms)
+{
+    if (st->timer[ACK_TIMER_ID].expire == 0)
+        tw_start(ACK_TIMER_ID, st->now_us + ms * 1000LL);
+}
+
+void stop_ack_timer(void)
+{
+    tw_stop(ACK_TIMER_ID);
+}
+
+static int scan_timer(int *nr)
+{
+    struct TIMER *t;
+
+    tw_advance(st->now_us / TW_TICK_US);
+    if (tw_empty(&st->expired))
+        return 0;
+
+    t = st->expired.next;
+    tw_unlink(t);
+    t->expire = 0;
+    *nr = (int)(t - st->timer);
+    return *nr == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
+}
+
+/* Earliest time (us) the wheel must be looked at again, 0 if no timer is running */
+static long long next_timer(void)
+{
+    int i, idx, n;
+    unsigned int bits;
+
+    if (!tw_empty(&st->expired))
+        return st->now_us;
+    if (st->tw_pending == 0)
+        return 0;
+
+    /* first non-empty level 0 slot up to the next cascade */
+    n = TW0_SIZE - (int)(st->tw_ts & TW0_MASK) - 1;
+    for (i = 1; i <= n; ) {
+        idx = (int)((st->tw_ts + i) & TW0_MASK);
+        bits = st->tw0_map[idx / 32] >> (idx % 32);
+        if (bits == 0) {
+            i += 32 - idx % 32;
+            continue;
+        }
+        while (!(bits & 1)) {
+            bits >>= 1;
+            i++;
+        }
+        if (i <= n)
+            return (st->tw_ts + i) * TW_TICK_US;
+        break;
+    }
+
+    return ((st->tw_ts | TW0_MASK) + 1) * TW_TICK_US;
+}
+
+/* Network Layer Functions */
+
+
+void enable_network_layer(void)
+{
+    st->network_layer_active = 1;
+}
+
+void disable_network_layer(void)
+{
+    st->network_layer_active = 0;
+}
+
+/* Time (us) the bonded channels take for 3/4 of a packet */
+#define pkt_gap() (((PKT_LEN * 3 / 4) * 8000000LL + (long long)st->chan_bps * st->bond - 1) / ((long long)st->chan_bps * st->bond))
+
+/* Station B starts sending after the first packets of A could have arrived */
+#define b_start() (st->chan_delay + 3 * PKT_LEN * 8000000LL / st->rx_bps)
+
+static int network_layer_ready(void)
+{
+    if (!st->network_layer_active)
+        return 0;
+
+    if (st->mode_flood) 
+        return 1;
+
+    if (st->now_us - st->network_ts < pkt_gap())
+        return 0;
+
+    if (st->station == 'b') {
+        if (st->now / 1000 / st->mode_cycle % 2 != st->mode_ibib) {
+            if (st->now_us - st->network_ts < (4000 + rand() % 500) * 1000LL)
+                return 0;
+        }
+        if (st->now_us < b_start())
+            return 0;
+    }
+
+    st->network_ts = st->now_us;
+
+    return 1;
+}
+
+/* Earliest time (us) network_layer_ready() may succeed, 0 if never */
+static long long network_layer_deadline(void)
+{
+    long long t, cycle_end;
+
+    if (!st->network_layer_active)
+        return 0;
+
+    if (st->mode_flood)
+        return st->now_us;
+
+    t = st->network_ts + pkt_gap();
+
+    if (st->station == 'b') {
+        if (t < b_start())
+            t = b_start();
+        if (t / 1000000 / st->mode_cycle % 2 != st->mode_ibib && t < st->network_ts + 4000000) {
+            /* idle phase: wait for the 4 s gap or the end of the phase */
+            cycle_end = (t / 1000000 / st->mode_cycle + 1) * st->mode_cycle * 1000000LL;
+            t = st->network_ts + 4000000 < cycle_end ? st->network_ts + 4000000 : cycle_end;
+        }
+    }
+
+    return t;
+}
+
+static int randA(void)
+{
+    return ((st->rand_a = st->rand_a * 214013L + 2531011L) >> 16) & 0x7fff;
+}
+
+static int randB(void)
+{
+    return ((st->rand_b = st->rand_b * 214013L + 2531011L) >> 16) & 0x7fff;
+}
+
+#define next_char() ((unsigned char)(my_rand() & 0xff))
+
+
+int get_packet(unsigned char *packet)
+{
+    int i, len;
+    int (*my_rand)(void) = st->station == 'a' ? randA : randB;
+
+    if (!st->layer3_ready)
+        ABORT("get_packet(): Network layer is not ready for a new packet");
+    
+    len = PKT_LEN;
+    for (i = 2; i < len; i++)
+        packet[i] = next_char();
+    *(unsigned short *)packet = (st->station - 'a' + 1) * 10000 + (st->pkt_no++ % 10000);
+
+    st->layer3_ready = 0;
+
+    return len;
+}
+
+
+void put_packet(unsigned char *packet, int len)
+{
+    int i, (*my_rand)(void) = st->station == 'a' ? randB : randA;
+
+    if (len != PKT_LEN) 
+        ABORT("Bad Packet length");
+
+    for (i = 2; i < PKT_LEN; i++) {
+        if (packet[i] != next_char()) 
+            ABORT("Network Layer received a bad packet from data link layer");
+    }
+    st->rpackets++;
+    st->rbytes += len;
+
+    if (st->now - st->report_ts > 2000 && st->now > st->ts0 + 2000) {
+        double bps;
+        bps = (double)st->rbytes * 8 * 1000 / (st->now - st->ts0);
+        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
+            st->rpackets, bps, bps / st->rx_bps / st->rx_bond * 100, st->noise, (double)st->noise/st->nbits);
+        st->report_ts = st->now;
+    }
+}
+
+#define DBG_EVENT    0x01
+#define DBG_FRAME    0x02
+#define DBG_WARNING  0x04
+
+void dbg_event(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (st->debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_frame(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (st->debug_mask & DBG_FRAME) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+void dbg_warning(char *fmt, ...)
+{
+	va_list arg_ptr;
+
+	if (st->debug_mask & DBG_WARNING) {
+		va_start(arg_ptr, fmt);
+		__v_lprintf(fmt, arg_ptr);
+		va_end(arg_ptr);
+	}
+}
+
+/* Event Generator */
+
+#define min_deadline(d, t) do { if ((t) && (d == 0 || (t) < d)) d = (t); } while (0)
+
+/* Time (us) the physical layer has to run again, 0 if it only waits for the socket */
+static long long phl_deadline(void)
+{
+    struct SQCHAN *q;
+    long long d = 0, t;
+    int n, i;
+
+    if (st->rblk_head && !rfq_full())
+        min_deadline(d, st->rblk_head->commit_ts);
+    if (st->imp_held && !rfq_full())
+        min_deadline(d, st->imp_held->ts);
+    if (st->trace)
+        min_deadline(d, st->trace_ts > st->phl_us ? st->trace_ts : st->phl_us + 1);
+
+    if (st->bond_held && st->bond_held[st->bond_next % BOND_WIN] && !rfq_full())
+        min_deadline(d, st->phl_us + 1);
+
+    /* sleep till the token bucket holds a flush unit, the burst or the rest of the queue */
+    for (i = 0; i < st->bond; i++) {
+        q = &st->sq[i];
+        if ((n = tb_want(q)) == 0)
+            continue;
+        t = q->send_ts + (n * TB_BYTE - q->tb_credit + st->chan_bps - 1) / st->chan_bps;
+        min_deadline(d, t > st->phl_us ? t : st->phl_us + 1);
+    }
+
+    return d;
+}
+
+/* Time (us) of the next thing wait_for_event() has to do by itself */
+static long long next_deadline(void)
+{
+    long long d = (st->mode_life + 1) * 1000LL, t;
+
+    min_deadline(d, next_timer());
+    if (!st->mode_thread)
+        min_deadline(d, phl_deadline());
+
+    /* network_layer_ready() has just failed at 'now' */
+    if ((t = network_layer_deadline()) != 0 && t <= st->now_us)
+        t = (st->now + 1) * 1000LL;
+    min_deadline(d, t);
+
+    return d;
+}
+
+
+static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
+static int bias_cnt;
+
+/*
+   Impairments of the received frames, applied as each frame is decoded:
+   loss, duplication, reordering (a frame held back by imp_gap lets the
+   following ones overtake it) and jitter around the propagation delay.
+   Frames not due yet wait in imp_held, ordered by release time.
+*/
+static long long imp_delay(void)
+{
+    double x;
+    int i;
+
+    if (st->imp_jitter == 0)
+        return 0;
+    if (st->imp_normal) { /* Irwin-Hall, standard deviation 1 */
+        for (x = -6.0, i = 0; i < 12; i++)
+            x += rng_uniform();
+    } else
+        x = 2.0 * rng_uniform() - 1.0;
+    x = st->imp_base + x * st->imp_jitter;
+    return x > 0.0 ? (long long)x : 0;
+}
+
+static void imp_hold(struct RCV_FRAME *rf, long long ts)
+{
+    struct RCV_FRAME **pp = &st->imp_held;
+
+    rf->ts = ts;
+    while (*pp && (*pp)->ts <= ts)
+        pp = &(*pp)->link;
+    rf->link = *pp;
+    *pp = rf;
+}
+
+/* Returns the number of frames put in rfq[], which has room for one */
+static int imp_frame(struct RCV_FRAME *rf)
+{
+    struct RCV_FRAME *dup;
+    long long d;
+
+    st->imp_frames++;
+    if (rng_uniform() < st->imp_loss) {
+        st->imp_lost++;
+        pool_put(rf->cap == RF_SMALL ? &st->rf_small : &st->rf_large, rf); /* not rf_free(): we own the pool */
+        return 0;
+    }
+
+    if (rng_uniform() < st->imp_dup) {
+        dup = rf_get(rf->cap == RF_SMALL ? &st->rf_small : &st->rf_large);
+        memcpy(dup->frame, rf->frame, rf->len);
+        dup->len = rf->len;
+        imp_hold(dup, st->phl_us + imp_delay());
+        st->imp_dups++;
+    }
+
+    d = imp_delay();
+    if (d > st->imp_base)
+        st->imp_delayed++;
+    if (rng_uniform() < st->imp_reorder) {
+        d += st->imp_gap;
+        st->imp_reordered++;
+    }
+    if (d == 0) {
+        rfq_put(rf);
+        return 1;
+    }
+    imp_hold(rf, st->phl_us + d);
+    return 0;
+}
+
+static int imp_release(void)
+{
+    struct RCV_FRAME *rf;
+    int frames = 0;
+
+    while ((rf = st->imp_held) != NULL && rf->ts <= st->phl_us && !rfq_full()) {
+        st->imp_held = rf->link;
+        rfq_put(rf);
+        frames++;
+    }
+    return frames;
+}
+
+static void imp_report(void)
+{
+    if (st->imp_on)
+        lprintf("Impairments: %d frames, %d lost, %d duplicated, %d reordered, %d delayed by jitter\n",
+            st->imp_frames, st->imp_lost, st->imp_dups, st->imp_reordered, st->imp_delayed);
+}
+
+/* Pass a received frame on to rfq[], which has room for one */
+static int phl_frame(struct RCV_FRAME *rf)
+{
+    if (st->imp_on)
+        return imp_frame(rf);
+    rfq_put(rf);
+    return 1;
+}
+
+/*
+   Frames of bonded channels are put back in the order they were sent.
+   Each channel delivers its frames in order and none is lost before this,
+   so a frame only waits for those sent before it on the other channels.
+   A frame outside the window, which a peer that restarted its numbering
+   would send, is passed on at once.
+*/
+static int bond_release(void)
+{
+    struct RCV_FRAME *rf;
+    int frames = 0;
+
+    while ((rf = st->bond_held[st->bond_next % BOND_WIN]) != NULL && !rfq_full()) {
+        st->bond_held[st->bond_next % BOND_WIN] = NULL;
+        st->bond_next = (st->bond_next + 1) & 0xffff;
+        st->bond_count--;
+        frames += phl_frame(rf);
+    }
+    return frames;
+}
+
+static int bond_frame(struct RCV_FRAME *rf)
+{
+    unsigned int d = (rf->seq - st->bond_next) & 0xffff;
+
+    if (rf->seq < 0 || d >= BOND_WIN || st->bond_held[rf->seq % BOND_WIN]) {
+        st->bond_late++;
+        return phl_frame(rf);
+    }
+    st->bond_held[rf->seq % BOND_WIN] = rf;
+    if (++st->bond_count > st->bond_peak)
+        st->bond_peak = st->bond_count;
+    if (d > 0) {
+        st->bond_ahead++;
+        return 0;
+    }
+    return bond_release();
+}
+
+static void bond_report(void)
+{
+    if (st->bond_held)
+        lprintf("Bonded receive: %d frames held back for one sent before them, at most %d at once, %d out of the window\n",
+            st->bond_ahead, st->bond_peak, st->bond_late);
+}
+
+/* A byte of the framing of bonded channels: a switch to another channel or a nibble of the sequence number */
+static void bond_byte(unsigned char c)
+{
+    if (c >= BOND_SWITCH) {
+        st->bond_rf[st->bond_rx] = st->rf_buf;
+        st->bond_rx = (c - BOND_SWITCH) % BOND_MAX;
+        st->rf_buf = st->bond_rf[st->bond_rx];
+    } else if (c < BOND_SEQ + 0x10 && st->rf_buf)
+        st->rf_buf->seq = (st->rf_buf->seq & 0xffff) >> 4 | (c & 0x0f) << 12;
+}
+
+/* The first byte in p..end that is not a data nibble, end if none */
+static unsigned char *bond_scan(unsigned char *p, unsigned char *end)
+{
+#ifdef HAVE_SSE2
+    const __m128i nib = _mm_set1_epi8(0x0f), zero = _mm_setzero_si128();
+    int m;
+
+    for (; p + 16 <= end; p += 16) {
+        m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(_mm_loadu_si128((const __m128i *)p), nib), zero)) & 0xffff;
+        if (m) {
+            while (!(m & 1)) {
+                m >>= 1;
+                p++;
+            }
+            return p;
         }
-        
-        /* test socket send/receive */
-        tm.tv_sec = tm.tv_usec = 0;
-        FD_ZERO(&rfd);
-        FD_ZERO(&wfd);
-        FD_SET(sock, &rfd);
-        FD_SET(sock, &wfd);
+    }
+#endif
+    for (; p < end && *p < BOND_SEQ; p++)
+        ;
+    return p;
+}
+
+/* 
+   Decode the received data due by now, a block at a time: memchr() finds
+   the next 0xff and the nibbles before it are merged into the frame in one
+   go. From bonded channels the frames are put in order by bond_frame().
+   Returns the number of frames completed.
+*/
+static int phl_commit(void)
+{
+    struct BLK *blk;
+    unsigned char *p, *q, *end;
+    int frames = 0;
+
+    if (st->imp_held)
+        frames += imp_release();
+    if (st->bond_held)
+        frames += bond_release();
+
+    while ((blk = st->rblk_head) != NULL && blk->commit_ts <= st->phl_us) {
+        if (st->ts0 == 0) {
+            st->ts0 = (int)(st->phl_us / 1000);
+            if (st->ts0 >= (blk->wptr - blk->rptr) / 2)
+                st->ts0 -= (blk->wptr - blk->rptr) / 2;
+        }
+
+        p = blk->data + blk->rptr;
+        end = blk->data + blk->wptr;
+        while (p < end) {
+            if (st->bond_held)
+                q = bond_scan(p, end);
+            else if ((q = (unsigned char *)memchr(p, 0xff, end - p)) == NULL)
+                q = end;
+            if (st->rf_buf)
+                rf_append(p, (int)(q - p));
+            p = q;
+            if (p == end)
+                break;
+            if (*p != 0xff) {
+                bond_byte(*p++);
+                continue;
+            }
+
+            /* delimiter */
+            if (st->rf_buf == NULL) 
+                st->rf_buf = rf_get(&st->rf_small);
+            else if (st->rf_buf->len > 0) {
+                if (rfq_full()) {
+                    blk->rptr = (int)(p - blk->data);
+                    return frames;
+                }
+                if (st->bond_held)
+                    frames += bond_frame(st->rf_buf);
+                else
+                    frames += phl_frame(st->rf_buf);
+                st->rf_buf = NULL;
+            }
+            p++;
+        }
+
+        st->rblk_head = blk->link;
+        pool_put(&st->blk_pool, blk);
+    }
+
+    return frames;
+}
+
+int recv_frame(unsigned char *buf, int size)
+{
+    int len;
+    struct RCV_FRAME *rf;
+    char msg[256];
+
+    if (rfq_len() == 0) 
+        ABORT("recv_frame(): Receiving Queue is empty");
+
+    rf = st->rfq[st->rfq_head];
+    len = rf->len;
+
+    if (size < len) { 
+        sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
+        ABORT(msg);
+    }
+    
+    memcpy(buf, rf->frame, len);
+
+    rf_free(rf); 
+    ATOMIC_STORE(&st->rfq_head, (st->rfq_head + 1) % RFQ_SIZE);
+
+    return len;
+}
+
+/* Borrow the next received frame without copying, give it back with release_frame() */
+unsigned char *recv_frame_ref(int *len)
+{
+    struct RCV_FRAME *rf;
+
+    if (rfq_len() == 0) 
+        ABORT("recv_frame_ref(): Receiving Queue is empty");
+
+    rf = st->rfq[st->rfq_head];
+    ATOMIC_STORE(&st->rfq_head, (st->rfq_head + 1) % RFQ_SIZE);
+
+    *len = rf->len;
+    return rf->frame;
+}
+
+void release_frame(unsigned char *frame)
+{
+    rf_free((struct RCV_FRAME *)(frame - offsetof(struct RCV_FRAME, frame)));
+}
+
+/* Physical layer thread */
+
+/*
+   With --thread the socket, the channel emulation and the frame decoder run
+   on a thread of their own, so a slow handler in the protocol does not hold
+   back the channel. The threads only share the sending queue sq[] and the
+   received frame queue rfq[], each a single-producer/single-consumer ring
+   whose indices are published with release stores. The physical layer
+   thread wakes the protocol thread when frames arrive or when the sending
+   queue drains below its level; bytes queued by the protocol are picked
+   up within PHL_POLL_US.
+*/
+
+#define PHL_POLL_US 1000
+
+static void phl_signal(void)
+{
+    mutex_lock(&st->phl_lock);
+    st->phl_wake = 1;
+    cond_broadcast(&st->phl_cond);
+    mutex_unlock(&st->phl_lock);
+}
+
+static void phl_wait(long long us)
+{
+    mutex_lock(&st->phl_lock);
+    if (!st->phl_wake && us > 0)
+        cond_timedwait(&st->phl_cond, &st->phl_lock, us);
+    st->phl_wake = 0;
+    mutex_unlock(&st->phl_lock);
+}
+
+THREAD_PROC(phl_thread)
+{
+    long long d;
+    int ready, level, n;
+
+    station_select((struct station *)arg);
+
+    for (;;) {
+        st->phl_us = get_us();
+        trace_step();
+
+        if (phl_commit())
+            phl_signal();
+
+        ready = st->tp->poll();
+
+        if (ready & PHL_WRITABLE) {
+            n = sq_ready_len();
+            level = ATOMIC_LOAD(&st->sq_full) ? st->sq_level : st->sq_high;
+            socket_send();
+            if (n >= level && sq_ready_len() < level)
+                phl_signal();
+        }
+
+        if (ready & PHL_READABLE)
+            socket_recv_burst();
+
+        d = st->phl_us + PHL_POLL_US;
+        min_deadline(d, phl_deadline());
+        d -= get_us();
+        st->tp->wait(d > 0 ? d : 0);
+    }
+
+    return 0;
+}
+
+static void phl_thread_start(void)
+{
+    mutex_init(&st->phl_lock);
+    cond_init(&st->phl_cond);
+    thread_create(phl_thread, st);
+}
+
+/* One pass over the event sources, LINK_IDLE if none has an event */
+static int poll_event(int *arg)
+{
+    int event, ready;
+
+    st->now_us = get_us();
+    st->now = (int)(st->now_us / 1000);
 
-        if (select(sock + 1, &rfd, &wfd, 0, &tm) < 0) 
-            ABORT("system select()");
+    if (!st->mode_thread) {
+        st->phl_us = st->now_us;
+        trace_step();
+
+        /* send the frames queued by the last event */
+        sq_flush();
+
+        /* commit received socket data */
+        phl_commit();
+    }
+
+    if (rfq_len() > 0)
+        return FRAME_RECEIVED;
+
+    if (!st->mode_thread) {
+        /* test socket send/receive */
+        ready = st->tp->poll();
 
         /* socket send */
-        if (FD_ISSET(sock, &wfd)) 
+        if (ready & PHL_WRITABLE) 
             socket_send();
 
         /* socket receive */
-        if (FD_ISSET(sock, &rfd)) 
-            socket_recv();
+        if (ready & PHL_READABLE) 
+            socket_recv_burst();
+    }
 
-        /* network layer event */
-        if (network_layer_ready()) {
-            layer3_ready = 1;
-            return NETWORK_LAYER_READY;
-        }
+    /* network layer event */
+    if (network_layer_ready()) {
+        st->layer3_ready = 1;
+        return NETWORK_LAYER_READY;
+    }
+
+    /* check all timers */
+    if ((event = scan_timer(arg)) != 0)
+        return event;
+
+    /* physical layer event */
+    if (st->inform_phl_ready && sq_ready_len() < (st->sq_full ? st->sq_level : st->sq_high)) {
+        st->inform_phl_ready = 0;
+        st->sq_full = 0;
+        return PHYSICAL_LAYER_READY;
+    }
+
+    return LINK_IDLE;
+}
+
+/* Reports at the end of the station's life */
+static void station_quit(void)
+{
+    send_report();
+    imp_report();
+    bond_report();
+    pool_report();
+    lprintf("Quit.\n");
+}
+
+int wait_for_event(int *arg)
+{
+    int event;
 
-        /* check all timers */
-        if ((event = scan_timer(arg)) != 0)
+    for (;;) {
+        if ((event = poll_event(arg)) != LINK_IDLE)
             return event;
 
-        /* physical layer event */
-        if (inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
-            inform_phl_ready = 0;
-            return PHYSICAL_LAYER_READY;
-        }
+        if (st->mode_thread) {
+            magic_check();
+            phl_wait(next_deadline() - get_us());
+        } else if (st->mode_tickless) {
+            long long us0, us, t;
+            static time_t last_warn;
 
-        /* delay 'mode_tick' ms */
-        if (1) {
+            magic_check();
+            us0 = get_us();
+            us = next_deadline() - us0;
+            if (us < 0)
+                us = 0;
+            st->tp->wait(us);
+            t = get_us() - us0;
+            if (t > us + 50000 && time(0) > last_warn + 1) {
+                lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
+                    (int)(us / 1000), (int)(t / 1000));
+                last_warn = time(0);
+            }
+        } else if (1) { /* delay 'mode_tick' ms */
             int ms0, t;
             static time_t last_warn;
             ms0 = get_ms();
             magic_check();
-            Sleep(mode_tick);
+            Sleep(st->mode_tick);
             t = get_ms() - ms0;
-            if (t > mode_tick + 50 && time(0) > last_warn + 1) {
+            if (t > st->mode_tick + 50 && time(0) > last_warn + 1) {
                 lprintf("** WARNING: System too busy, sleep %d ms, but be awakened %d ms later\n", 
-                    mode_tick, t);
+                    st->mode_tick, t);
                 last_warn = time(0);
             }
         } else {
@@ -872,29 +4214,462 @@ int wait_for_event(int *arg)
             if (start_ms == 0)
                 start_ms = ms;
             else if (ms - wakeup_ms > 1) {
-                ticks = (ms - start_ms) / mode_tick;
+                ticks = (ms - start_ms) / st->mode_tick;
                 lprintf("====== CPU BUSY for %d ms (cnt %d)\n", ms - wakeup_ms, ++busy_cnt);
                 lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
             }
 
             magic_check();
             ms = get_ms();
-            Sleep(mode_tick);
+            Sleep(st->mode_tick);
             wakeup_ms = get_ms();
 
             ms = wakeup_ms - ms;
-            if (ms > mode_tick + 1 || ms < mode_tick - 1) 
-                lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
+            if (ms > st->mode_tick + 1 || ms < st->mode_tick - 1) 
+                lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", st->mode_tick, st->mode_tick, ms - st->mode_tick, ++bias_cnt);
         }
 
-        if (now > mode_life) {
-            lprintf("Quit.\n");
+        if (st->now > st->mode_life) {
+            station_quit();
+            if (st->mode_sim)
+                sim_quit();
             exit(0);
         }
     }
 }
 
 
+/* Link context API, see protocol.h */
+
+void link_select(struct station *l)
+{
+    station_select(l);
+}
+
+struct station *link_current(void)
+{
+    return st;
+}
+
+int link_poll(struct station *l, int *arg)
+{
+    int event;
+
+    station_select(l);
+    if (st->quit == 2)
+        return LINK_QUIT;
+    if ((event = poll_event(arg)) != LINK_IDLE)
+        return event;
+    if (st->now > st->mode_life)
+        st->quit = 1;
+    if (!st->quit)
+        return LINK_IDLE;
+
+    station_quit();
+    shm_close(st->shm); /* the peer quits in turn */
+    st->quit = 2;
+    return LINK_QUIT;
+}
+
+/* At the latest one tick away, as data of the peer wakes nobody */
+long long link_deadline(struct station *l)
+{
+    long long d;
+
+    station_select(l);
+    d = next_deadline();
+    min_deadline(d, st->now_us + st->mode_tick * 1000LL);
+    return d;
+}
+
+int link_wait_for_event(struct station *l, int *arg)
+{
+    station_select(l);
+    return wait_for_event(arg);
+}
+
+void link_enable_network_layer(struct station *l)
+{
+    station_select(l);
+    enable_network_layer();
+}
+
+void link_disable_network_layer(struct station *l)
+{
+    station_select(l);
+    disable_network_layer();
+}
+
+int link_get_packet(struct station *l, unsigned char *packet)
+{
+    station_select(l);
+    return get_packet(packet);
+}
+
+void link_put_packet(struct station *l, unsigned char *packet, int len)
+{
+    station_select(l);
+    put_packet(packet, len);
+}
+
+int link_recv_frame(struct station *l, unsigned char *buf, int size)
+{
+    station_select(l);
+    return recv_frame(buf, size);
+}
+
+unsigned char *link_recv_frame_ref(struct station *l, int *len)
+{
+    station_select(l);
+    return recv_frame_ref(len);
+}
+
+void link_release_frame(struct station *l, unsigned char *frame)
+{
+    station_select(l);
+    release_frame(frame);
+}
+
+void link_send_frame(struct station *l, unsigned char *frame, int len)
+{
+    station_select(l);
+    send_frame(frame, len);
+}
+
+void link_send_frame_iov(struct station *l, unsigned char *head, int hlen, unsigned char *data, int dlen)
+{
+    station_select(l);
+    send_frame_iov(head, hlen, data, dlen);
+}
+
+int link_phl_sq_len(struct station *l)
+{
+    station_select(l);
+    return phl_sq_len();
+}
+
+void link_start_timer(struct station *l, unsigned int nr, unsigned int ms)
+{
+    station_select(l);
+    start_timer(nr, ms);
+}
+
+void link_stop_timer(struct station *l, unsigned int nr)
+{
+    station_select(l);
+    stop_timer(nr);
+}
+
+void link_start_ack_timer(struct station *l, unsigned int ms)
+{
+    station_select(l);
+    start_ack_timer(ms);
+}
+
+void link_stop_ack_timer(struct station *l)
+{
+    station_select(l);
+    stop_ack_timer();
+}
+
+char *link_station_name(struct station *l)
+{
+    station_select(l);
+    return station_name();
+}
+
+/* Link farm */
+
+/*
+   --farm=<pairs>[,<threads>[,<file>]] runs that many linked pairs on a
+   pool of threads, one per CPU by default, each pinned to its CPU. A pair
+   is the unit of work: a worker polls both stations till they are idle
+   and files the pair under its next deadline in its own run queue. A
+   worker with nothing due takes a due pair from another's queue, so a
+   pair moves to whichever thread is free. Each line of the file holds
+   more options for one pair, taken in turn, such as "-r 64000 -b 1e-5".
+*/
+
+#define FARM_IDLE 1000          /* us, longest nap of an idle worker */
+
+struct FARM_TASK {
+    struct station *l[2];
+    void *data[2];
+    int quit[2];
+    long long due;              /* us */
+};
+
+struct FARM_WORKER {
+    mutex_t lock;
+    struct FARM_TASK **heap;    /* min-heap by due */
+    int n;
+    int id;
+    long long steps, steals;
+};
+
+static struct {
+    struct FARM_WORKER *w;
+    int nw;
+    int live;                   /* pairs not over yet */
+    int running;                /* workers not returned yet */
+} farm;
+
+static void farm_push(struct FARM_WORKER *w, struct FARM_TASK *t)
+{
+    int i, parent;
+
+    mutex_lock(&w->lock);
+    for (i = w->n++; i > 0 && w->heap[parent = (i - 1) / 2]->due > t->due; i = parent)
+        w->heap[i] = w->heap[parent];
+    w->heap[i] = t;
+    mutex_unlock(&w->lock);
+}
+
+/* The earliest pair if it is due by 'now' */
+static struct FARM_TASK *farm_pop(struct FARM_WORKER *w, long long now)
+{
+    struct FARM_TASK *t = NULL, *last;
+    int i, child;
+
+    mutex_lock(&w->lock);
+    if (w->n > 0 && w->heap[0]->due <= now) {
+        t = w->heap[0];
+        last = w->heap[--w->n];
+        for (i = 0; (child = 2 * i + 1) < w->n; i = child) {
+            if (child + 1 < w->n && w->heap[child + 1]->due < w->heap[child]->due)
+                child++;
+            if (last->due <= w->heap[child]->due)
+                break;
+            w->heap[i] = w->heap[child];
+        }
+        w->heap[i] = last;
+    }
+    mutex_unlock(&w->lock);
+    return t;
+}
+
+/* Run both stations of the pair till they are idle, 0 once both quit */
+static long long farm_step(struct FARM_TASK *t)
+{
+    long long due = 0, d;
+    int i, event, arg;
+
+    for (i = 0; i < 2; i++) {
+        if (t->quit[i])
+            continue;
+        while ((event = link_poll(t->l[i], &arg)) >= 0)
+            app_event(t->data[i], event, arg);
+        if (event == LINK_QUIT) {
+            t->quit[i] = 1;
+            continue;
+        }
+        d = link_deadline(t->l[i]);
+        min_deadline(due, d);
+    }
+    return due;
+}
+
+static void farm_nap(long long us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    usleep((useconds_t)us);
+#endif
+}
+
+static void farm_pin(int cpu)
+{
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+static void farm_work(struct FARM_WORKER *w)
+{
+    struct FARM_TASK *t;
+    long long now, d;
+    int i;
+
+    farm_pin(w->id % cpu_count());
+
+    while (ATOMIC_LOAD(&farm.live) > 0) {
+        now = get_us();
+        t = farm_pop(w, now);
+        for (i = 1; t == NULL && i < farm.nw; i++) {
+            t = farm_pop(&farm.w[(w->id + i) % farm.nw], now);
+            if (t)
+                w->steals++;
+        }
+
+        if (t == NULL) {
+            mutex_lock(&w->lock);
+            d = w->n > 0 ? w->heap[0]->due - now : FARM_IDLE;
+            mutex_unlock(&w->lock);
+            farm_nap(d < FARM_IDLE ? (d > 0 ? d : 0) : FARM_IDLE);
+            continue;
+        }
+
+        w->steps++;
+        if ((t->due = farm_step(t)) != 0)
+            farm_push(w, t);
+        else {
+            mutex_lock(&farm.w[0].lock); /* any lock orders the count */
+            farm.live--;
+            mutex_unlock(&farm.w[0].lock);
+        }
+    }
+}
+
+THREAD_PROC(farm_thread)
+{
+    farm_work((struct FARM_WORKER *)arg);
+    mutex_lock(&farm.w[0].lock);
+    farm.running--;
+    mutex_unlock(&farm.w[0].lock);
+    return 0;
+}
+
+/* Command line of pair 'i': the farm's own, then a line of the file */
+static char **farm_argv(int argc, char **argv, char **lines, int nlines, int i, int *n)
+{
+    char **v, *p;
+    int max = argc + 64;
+
+    v = (char **)calloc(max + 1, sizeof(char *));
+    if (v == NULL)
+        ABORT("No enough memory");
+    memcpy(v, argv, argc * sizeof(char *));
+    *n = argc;
+    if (nlines > 0) {
+        p = strdup(lines[i % nlines]);
+        for (p = strtok(p, " \t\r\n"); p && *n < max; p = strtok(NULL, " \t\r\n"))
+            v[(*n)++] = p;
+    }
+    return v;
+}
+
+/* Jain's fairness index of the stations' efficiency, 1: all alike */
+static void farm_report(struct FARM_TASK *tasks, int pairs, long long us)
+{
+    double x, sum = 0.0, sum2 = 0.0, lo = 1e9, hi = 0.0, packets = 0.0, bits = 0.0;
+    struct station *s;
+    long long steps = 0, steals = 0;
+    int i, j, n = 0;
+
+    for (i = 0; i < pairs; i++) {
+        for (j = 0; j < 2; j++) {
+            s = tasks[i].l[j];
+            packets += s->rpackets;
+            bits += s->rbytes * 8.0;
+            x = s->now > s->ts0 && s->ts0 ? (double)s->rbytes * 8 * 1000 / (s->now - s->ts0) / s->rx_bps / s->rx_bond : 0.0;
+            sum += x;
+            sum2 += x * x;
+            lo = x < lo ? x : lo;
+            hi = x > hi ? x : hi;
+            n++;
+        }
+    }
+    for (i = 0; i < farm.nw; i++) {
+        steps += farm.w[i].steps;
+        steals += farm.w[i].steals;
+    }
+
+    lprintf("Farm: %d pairs on %d threads, %.1f s\n", pairs, farm.nw, us / 1e6);
+    lprintf("Farm: %.0f packets received, %.0f packets/s, %.3f Mbps in all\n",
+        packets, packets * 1e6 / us, bits / us);
+    lprintf("Farm: efficiency mean %.2f%%, min %.2f%%, max %.2f%%, Jain's fairness %.4f\n",
+        sum / n * 100, lo * 100, hi * 100, sum2 > 0.0 ? sum * sum / (n * sum2) : 1.0);
+    lprintf("Farm: %lld steps, %lld (%.2f%%) stolen\n", steps, steals, steps ? 100.0 * steals / steps : 0.0);
+}
+
+int link_farm(int argc, char **argv, void *(*open)(struct station *l), void (*event)(void *data, int event, int arg))
+{
+    char file[256], line[1024], **lines = NULL, **v;
+    int opt, pairs = 0, threads = 0, nlines = 0, i, j, n;
+    struct FARM_TASK *tasks;
+    FILE *fp;
+    long long t0;
+
+    app_open = open;
+    app_event = event;
+    optind = 0;
+    opterr = 0; /* config() tells about bad options */
+    file[0] = 0;
+    while ((opt = getopt_long(argc, argv, OPT_SHORT, intopts, NULL)) != -1) {
+        if (opt == 'F' && sscanf(optarg, "%d,%d,%255s", &pairs, &threads, file) < 1)
+            pairs = 0;
+    }
+    opterr = 1;
+    optind = 0; /* config() parses the command line again */
+    if (pairs <= 0)
+        return 0;
+    if (threads <= 0)
+        threads = cpu_count();
+
+    if (file[0]) {
+        if ((fp = fopen(file, "r")) == NULL) {
+            printf("Failed to open farm file \"%s\": %s\n", file, strerror(errno));
+            exit(0);
+        }
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[strspn(line, " \t\r\n")] == 0 || line[0] == '#')
+                continue;
+            lines = (char **)realloc(lines, (nlines + 1) * sizeof(char *));
+            if (lines == NULL || (lines[nlines++] = strdup(line)) == NULL)
+                ABORT("No enough memory");
+        }
+        fclose(fp);
+    }
+
+    tasks = (struct FARM_TASK *)calloc(pairs, sizeof(struct FARM_TASK));
+    farm.w = (struct FARM_WORKER *)calloc(threads, sizeof(struct FARM_WORKER));
+    if (tasks == NULL || farm.w == NULL)
+        ABORT("No enough memory");
+    farm.nw = threads;
+    for (i = 0; i < threads; i++) {
+        mutex_init(&farm.w[i].lock);
+        farm.w[i].id = i;
+        farm.w[i].heap = (struct FARM_TASK **)calloc(pairs, sizeof(struct FARM_TASK *));
+        if (farm.w[i].heap == NULL)
+            ABORT("No enough memory");
+    }
+
+    for (i = 0; i < pairs; i++) {
+        v = farm_argv(argc, argv, lines, nlines, i, &n);
+        link_pair(n, v, &tasks[i].l[0], &tasks[i].l[1]);
+        for (j = 0; j < 2; j++) {
+            link_select(tasks[i].l[j]);
+            tasks[i].data[j] = open(tasks[i].l[j]);
+        }
+        farm_push(&farm.w[i % threads], &tasks[i]);
+    }
+    farm.live = pairs;
+    farm.running = threads - 1;
+
+    log_file = NULL; /* the farm's report goes to stdout */
+    log_quiet = 0;
+    lprintf("Farm: %d pairs on %d threads\n", pairs, threads);
+
+    t0 = get_us();
+    for (i = 1; i < threads; i++)
+        thread_create(farm_thread, &farm.w[i]);
+    farm_work(&farm.w[0]);
+    while (ATOMIC_LOAD(&farm.running) > 0)
+        farm_nap(FARM_IDLE);
+
+    log_file = NULL;
+    log_quiet = 0;
+    farm_report(tasks, pairs, get_us() - t0);
+    return 1;
+}
+
 /* Memory Protection */
 static unsigned int foot_magic[NMAGIC];
 
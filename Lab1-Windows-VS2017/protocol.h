@@ -15,6 +15,13 @@ extern "C" {
 
 #include "lprintf.h"
 
+/* Thread-local storage class for per-station state of the protocol */
+#ifdef _MSC_VER
+#define STATION_LOCAL __declspec(thread)
+#else
+#define STATION_LOCAL __thread
+#endif
+
 /* Initalization */ 
 extern void protocol_init(int argc, char **argv);
 
@@ -37,15 +44,21 @@ extern void put_packet(unsigned char *packet, int len);
 
 /* Physical Layer functions */
 extern int  recv_frame(unsigned char *buf, int size);
+extern unsigned char *recv_frame_ref(int *len);
+extern void release_frame(unsigned char *frame);
 extern void send_frame(unsigned char *frame, int len);
+extern void send_frame_iov(unsigned char *head, int hlen, unsigned char *data, int dlen);
 
 extern int  phl_sq_len(void);
 
 /* CRC-32 polynomium coding function */
 extern unsigned int crc32(unsigned char *buf, int len);
+extern unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len);
 
 /* Timer Management functions */
 extern unsigned int get_ms(void);
+extern long long get_us(void);
+extern long long get_ns(void);
 extern void start_timer(unsigned int nr, unsigned int ms);
 extern void stop_timer(unsigned int nr);
 extern void start_ack_timer(unsigned int ms);
@@ -54,6 +67,52 @@ extern void stop_ack_timer(void);
 /* Protocol Debugger */
 extern char *station_name(void);
 
+/*
+   Link context: everything of one station. The calls above act on the
+   current station of the calling thread, the one protocol_init() sets up.
+   The link_*() calls take it explicitly and leave it current, so that one
+   process can run many links. link_pair() parses the command line like
+   protocol_init(), without a station name, and joins two new stations by
+   a channel inside the process. link_poll() never blocks: it returns an
+   event, LINK_IDLE if there is none before link_deadline(), or LINK_QUIT
+   once the station's life is over or its peer has quit.
+*/
+struct station;
+
+#define LINK_IDLE (-1)
+#define LINK_QUIT (-2)
+
+extern void link_pair(int argc, char **argv, struct station **a, struct station **b);
+extern void link_select(struct station *l);
+extern struct station *link_current(void);
+extern int  link_poll(struct station *l, int *arg);
+extern long long link_deadline(struct station *l);
+extern int  link_wait_for_event(struct station *l, int *arg);
+extern void link_enable_network_layer(struct station *l);
+extern void link_disable_network_layer(struct station *l);
+extern int  link_get_packet(struct station *l, unsigned char *packet);
+extern void link_put_packet(struct station *l, unsigned char *packet, int len);
+extern int  link_recv_frame(struct station *l, unsigned char *buf, int size);
+extern unsigned char *link_recv_frame_ref(struct station *l, int *len);
+extern void link_release_frame(struct station *l, unsigned char *frame);
+extern void link_send_frame(struct station *l, unsigned char *frame, int len);
+extern void link_send_frame_iov(struct station *l, unsigned char *head, int hlen, unsigned char *data, int dlen);
+extern int  link_phl_sq_len(struct station *l);
+extern void link_start_timer(struct station *l, unsigned int nr, unsigned int ms);
+extern void link_stop_timer(struct station *l, unsigned int nr);
+extern void link_start_ack_timer(struct station *l, unsigned int ms);
+extern void link_stop_ack_timer(struct station *l);
+extern char *link_station_name(struct station *l);
+
+/*
+   With --farm on the command line, link_farm() runs the pairs it asks for
+   on a thread pool and returns 1 when they are over; otherwise it returns
+   0 at once. open() sets up the data of a station, current at the time,
+   and event() handles each event of the station that data belongs to.
+   Either way it keeps them: station B of --sim runs through them too.
+*/
+extern int  link_farm(int argc, char **argv, void *(*open)(struct station *l), void (*event)(void *data, int event, int arg));
+
 extern void dbg_event(char *fmt, ...);
 extern void dbg_frame(char *fmt, ...);
 extern void dbg_warning(char *fmt, ...);